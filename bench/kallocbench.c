@@ -0,0 +1,139 @@
+// Host-side benchmark and check of the kernel's page
+// allocator. Links kernel/kalloc.c, compiled for the host,
+// against stubs for the few kernel functions it calls, and
+// with its physical memory mapped at KERNBASE.
+//
+// make kallocbench builds it twice, with and without
+// KMEM_DEBUG, and runs both. Each run times single-page
+// kalloc()/kfree() pairs, bursts of allocations, and
+// megapage-sized kalloc_order() blocks, then writes to a
+// freed page and reports whether the allocator noticed.
+// Only the debug build should.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "kernel/param.h"
+#include "kernel/memlayout.h"
+
+#define PGSIZE 4096
+#define BURST 8192       // pages per burst
+#define MEGAORDER 9      // a megapage is 2^9 pages
+
+// kalloc.c's interface.
+void kinit(void);
+void *kalloc(void);
+void kfree(void*);
+void *kalloc_order(int);
+void kfree_order(void*, int);
+
+// Stubs for what kalloc.c needs from the rest of the kernel.
+// The benchmark is single-threaded, so locks do nothing.
+struct spinlock;
+void initlock(struct spinlock *lk, char *name) { }
+void acquire(struct spinlock *lk) { }
+void release(struct spinlock *lk) { }
+void push_off(void) { }
+void pop_off(void) { }
+int cpuid(void) { return 0; }
+
+static jmp_buf panicked;
+static char *panicmsg;
+
+void
+panic(char *s)
+{
+  panicmsg = s;
+  longjmp(panicked, 1);
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+report(char *what, double t0, long n)
+{
+  printf("  %-30s %10.1f ns/op\n", what, (now() - t0) / n);
+}
+
+int
+main(int argc, char *argv[])
+{
+  static char *pages[BURST];
+  long i, j, n;
+  double t0;
+  char *pa;
+
+  if(mmap((void*)KERNBASE, PHYSTOP - KERNBASE, PROT_READ|PROT_WRITE,
+          MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_POPULATE, -1, 0) == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+  if(setjmp(panicked)){
+    printf("panic: %s\n", panicmsg);
+    exit(1);
+  }
+  kinit();
+
+#ifdef KMEM_DEBUG
+  printf("kallocbench: KMEM_DEBUG\n");
+#else
+  printf("kallocbench: release\n");
+#endif
+
+  n = 1000000;
+  t0 = now();
+  for(i = 0; i < n; i++){
+    if((pa = kalloc()) == 0)
+      goto oom;
+    kfree(pa);
+  }
+  report("kalloc+kfree", t0, n);
+
+  n = 50;
+  t0 = now();
+  for(i = 0; i < n; i++){
+    for(j = 0; j < BURST; j++)
+      if((pages[j] = kalloc()) == 0)
+        goto oom;
+    for(j = 0; j < BURST; j++)
+      kfree(pages[j]);
+  }
+  report("burst of 8192 pages, per page", t0, n * BURST);
+
+  n = 2000;
+  t0 = now();
+  for(i = 0; i < n; i++){
+    if((pa = kalloc_order(MEGAORDER)) == 0)
+      goto oom;
+    kfree_order(pa, MEGAORDER);
+  }
+  report("kalloc_order(9)+kfree_order", t0, n);
+
+  // Write after free: the next allocations should find it.
+  pa = kalloc();
+  kfree(pa);
+  pa[100] = 7;
+  if(setjmp(panicked)){
+    printf("  write after free: caught (%s)\n", panicmsg);
+    exit(0);
+  }
+  for(j = 0; j < BURST; j++)
+    if((pages[j] = kalloc()) == 0)
+      goto oom;
+  printf("  write after free: not caught\n");
+  exit(0);
+
+oom:
+  printf("kallocbench: out of memory\n");
+  exit(1);
+}
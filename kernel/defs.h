@@ -2,6 +2,7 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct spinlock;
@@ -58,6 +59,7 @@ int		        createSwapFile(struct proc* p);
 int	          	readFromSwapFile(struct proc * p, char* buffer, uint placeOnFile, uint size);
 int		        writeToSwapFile(struct proc* p, char* buffer, uint placeOnFile, uint size);
 int		        removeSwapFile(struct proc* p);
+int		        copySwapFile(struct proc* from, struct proc* to, uint size);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -66,16 +68,37 @@ void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
+int             kzeroidle(void);
+void*           kalloc_order(int);
+void            kfree_order(void *, int);
 void            kfree(void *);
 void            kinit(void);
+void            kdup(void *);
+int             krefcount(void *);
+int             kfreecount(void);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+void            begin_unlogged(void);
+
+// paging.c
+int             pagefault(struct proc*, uint64, int);
+void            pagepin(struct proc*, uint64, uint64, int);
+void            pagetick(struct proc*);
+uint64          pagedealloc(struct proc*, uint64, uint64);
+void            pagefree(struct proc*, pagetable_t, uint64);
+void            pageswapfile(struct proc*);
+void            pageexec(struct proc*);
+int             pagefork(struct proc*, struct proc*);
+void            pageout(void) __attribute__((noreturn));
+void            pageoutkick(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -95,6 +118,7 @@ void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+void            kthread(void (*)(void), char*);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
@@ -107,6 +131,8 @@ void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
+void            timeryield(void);
+int             setpriority(int, int);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
@@ -124,10 +150,16 @@ void            pop_off(void);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
+int             tryacquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// slab.c
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -137,6 +169,21 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// swap.c
+void            swapinit(int, struct superblock*);
+int             swaparea(void);
+int             swapalloc(void);
+void            swapdup(int);
+void            swapfree(int);
+void            swaprw(int, char **, int, int);
+
+// zswap.c
+void            zswapinit(void);
+int             zswapstore(char*);
+void            zswapload(int, char*);
+void            zswapdup(int);
+void            zswapfree(int);
+
 // syscall.c
 int             argint(int, int*);
 int             argstr(int, char*, int);
@@ -155,6 +202,10 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+int             sleepticks(int);
+void            timeridle(void);
+void            timerbusy(void);
+void            timerkick(int);
 
 // uart.c
 void            uartinit(void);
@@ -167,12 +218,17 @@ int             uartgetc(void);
 void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
+pte_t *         walk(pagetable_t, uint64, int);
+pte_t *         walkmega(pagetable_t, uint64);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
+int             uvmmerge(pagetable_t, uint64);
+int             uvmsplit(pagetable_t, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+uint64          uvmcow(pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -190,6 +246,7 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_rwpages(uint, void **, int, int);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
@@ -109,12 +110,16 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  acquiresleep(&p->pglock);
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  pagefree(p, oldpagetable, oldsz);
   proc_freepagetable(oldpagetable, oldsz);
+  pageexec(p);
+  releasesleep(&p->pglock);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
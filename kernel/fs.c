@@ -15,8 +15,8 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
-#include "proc.h"
 #include "sleeplock.h"
+#include "proc.h"
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
@@ -44,6 +44,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  swapinit(dev, &sb);
 }
 
 // Zero a block.
@@ -764,8 +765,41 @@ removeSwapFile(struct proc* p)
 
 }
 
+// Swap file contents don't need to survive a crash, so page
+// data is written with bwrite() rather than through the log.
+// Only growing the file (bmap() allocating blocks, the inode's
+// new size) goes through the log, a few blocks per transaction
+// as in kfilewrite(). createSwapFile() grows the file to its
+// full size at once, because writes to it can come from inside
+// another transaction (see pageswapfile() in paging.c), where
+// a nested begin_op() could wait forever for log space; later
+// writes skip the log. The zeroed blocks that balloc() logged
+// may not be committed yet, though, so page data is written
+// under begin_unlogged(), which doesn't wait for log space.
+static void
+swapgrow(struct inode *ip, uint size)
+{
+  int max = (MAXOPBLOCKS-1-1-2) / 2;
+  uint bn, end;
+
+  ilock(ip);
+  while(ip->size < size){
+    iunlock(ip);
+    begin_op();
+    ilock(ip);
+    end = (size + BSIZE - 1) / BSIZE;
+    for(bn = ip->size / BSIZE; bn < end && bn < ip->size / BSIZE + max; bn++)
+      bmap(ip, bn);
+    ip->size = bn * BSIZE < size ? bn * BSIZE : size;
+    iupdate(ip);
+    iunlock(ip);
+    end_op();
+    ilock(ip);
+  }
+  iunlock(ip);
+}
 
-//return 0 on success
+//return 0 on success, -1 if the file could not be created
 int
 createSwapFile(struct proc* p)
 {
@@ -777,10 +811,17 @@ createSwapFile(struct proc* p)
   begin_op();
   
   struct inode * in = create(path, T_FILE, 0, 0);
+  if(in == 0){
+    end_op();
+    return -1;
+  }
   iunlock(in);
   p->swapFile = filealloc();
-  if (p->swapFile == 0)
-    panic("no slot for files on /store");
+  if (p->swapFile == 0){
+    iput(in);
+    end_op();
+    return -1;
+  }
 
   p->swapFile->ip = in;
   p->swapFile->type = FD_INODE;
@@ -789,6 +830,7 @@ createSwapFile(struct proc* p)
   p->swapFile->writable = O_RDWR;
     end_op();
 
+  swapgrow(in, MAX_SWAP_PAGES*PGSIZE);
     return 0;
 }
 
@@ -796,8 +838,31 @@ createSwapFile(struct proc* p)
 int
 writeToSwapFile(struct proc * p, char* buffer, uint placeOnFile, uint size)
 {
-  p->swapFile->off = placeOnFile;
-  return kfilewrite(p->swapFile, (uint64)buffer, size);
+  struct inode *ip = p->swapFile->ip;
+  struct buf *bp;
+  uint tot, off, m;
+
+  if(placeOnFile + size < placeOnFile)
+    return -1;
+
+  begin_unlogged();
+  ilock(ip);
+  if(placeOnFile + size > ip->size){
+    iunlock(ip);
+    end_op();
+    return -1;
+  }
+  off = placeOnFile;
+  for(tot = 0; tot < size; tot += m, off += m, buffer += m){
+    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    m = min(size - tot, BSIZE - off%BSIZE);
+    memmove(bp->data + (off % BSIZE), buffer, m);
+    bwrite(bp);
+    brelse(bp);
+  }
+  iunlock(ip);
+  end_op();
+  return size;
 }
 
 //return as sys_read (-1 when error)
@@ -806,4 +871,38 @@ readFromSwapFile(struct proc * p, char* buffer, uint placeOnFile, uint size)
 {
   p->swapFile->off = placeOnFile;
   return kfileread(p->swapFile, (uint64)buffer,  size);
-}
\ No newline at end of file
+}
+//copy the first size bytes of from's swap file into to's,
+//a block at a time straight out of the buffer cache.
+//return 0 on success, -1 on error
+int
+copySwapFile(struct proc* from, struct proc* to, uint size)
+{
+  struct inode *src = from->swapFile->ip;
+  struct inode *dst = to->swapFile->ip;
+  struct buf *sbp, *dbp;
+  uint off, n;
+
+  begin_unlogged();
+  ilock(src);
+  ilock(dst);
+  if(size > src->size || size > dst->size){
+    iunlock(dst);
+    iunlock(src);
+    end_op();
+    return -1;
+  }
+  for(off = 0; off < size; off += n){
+    n = min(size - off, BSIZE);
+    sbp = bread(src->dev, bmap(src, off / BSIZE));
+    dbp = bread(dst->dev, bmap(dst, off / BSIZE));
+    memmove(dbp->data, sbp->data, n);
+    bwrite(dbp);
+    brelse(dbp);
+    brelse(sbp);
+  }
+  iunlock(dst);
+  iunlock(src);
+  end_op();
+  return 0;
+}
@@ -7,7 +7,10 @@
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
-//                                          free bit map | data blocks]
+//                              free bit map | data blocks | swap area]
+//
+// The swap area lies outside the file system proper (past
+// sb.size); paging uses it as raw page-sized slots, see swap.c.
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -20,6 +23,8 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint swapstart;    // Block number of first swap area block
+  uint nswap;        // Number of swap area blocks (0 if none)
 };
 
 #define FSMAGIC 0x10203040
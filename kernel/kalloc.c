@@ -1,6 +1,32 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or with kalloc_order() runs of 2^k pages, aligned to
+// their size.
+// A page can have several references (copy-on-write
+// fork shares user pages); kfree() drops one, and frees
+// the page with the last.
+//
+// Free memory is kept by a buddy allocator: a free block of
+// 2^k pages is on list free[k], and freeing a block merges it
+// with its buddy, the other half of the block of 2^(k+1)
+// pages containing it, whenever that is free too.
+//
+// Single pages are cached on a free list per CPU, so that CPUs
+// allocating and freeing pages at the same time don't contend
+// for a lock. A CPU whose list runs dry refills it with a batch
+// of pages from the buddy allocator, or failing that steals
+// half of another CPU's list; one whose list grows too long
+// gives a batch back.
+//
+// CPUs with nothing to run zero free pages ahead of time
+// (kzeroidle()), so that kalloc_zeroed() seldom has to.
+//
+// A kernel built with KMEM_DEBUG fills freed pages with junk,
+// and checks on allocation that nothing has written to them
+// since, to catch uses after free; allocated pages are filled
+// with different junk to catch uses of uninitialized memory.
+// Other kernels leave pages as they are.
 
 #include "types.h"
 #include "param.h"
@@ -14,19 +40,74 @@ void freerange(void *pa_start, void *pa_end);
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+#define BATCH 32        // pages moved between lists at a time
+#define CPUMAX (2*BATCH) // most pages on a CPU's list
+#define MAXORDER 10     // largest block is 2^MAXORDER pages
+#define ZEROMAX 256     // most pages kept zeroed
+#define JUNK_FREE 1     // KMEM_DEBUG fill of free pages
+#define JUNK_ALLOC 5    // ... and of newly allocated ones
+
 struct run {
   struct run *next;
+  struct run *prev;     // on the buddy lists only
 };
 
-struct {
+struct freelist {
   struct spinlock lock;
-  struct run *freelist;
+  struct run *head;
+  int n;                // pages on it
+};
+
+#define PA2IDX(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define BLOCKSIZE(k) ((uint64)PGSIZE << (k))
+
+struct {
+  struct spinlock lock;       // guards free, order and nfree
+  struct run *free[MAXORDER+1]; // free blocks of 2^k pages
+  uchar order[PA2IDX(PHYSTOP)]; // 1+k at the first page of a free block
+  int nfree;                  // pages in free blocks
+  struct freelist cpu[NCPU];
+  struct freelist zeroed;     // free pages already zeroed
+  int ref[PA2IDX(PHYSTOP)]; // references to each page, changed atomically
 } kmem;
 
+// With KMEM_DEBUG, fill n bytes at pa with junk c.
+static void
+junk(void *pa, uint64 n, int c)
+{
+#ifdef KMEM_DEBUG
+  memset(pa, c, n);
+#endif
+}
+
+// With KMEM_DEBUG, check that the free pages in the n bytes
+// at pa still hold JUNK_FREE, apart from the free list links.
+static void
+checkjunk(void *pa, uint64 n)
+{
+#ifdef KMEM_DEBUG
+  char *a, *p;
+
+  for(a = pa; a < (char*)pa + n; a += PGSIZE){
+    for(p = a + sizeof(struct run); p < a + PGSIZE; p++){
+      if(*p != JUNK_FREE){
+        printf("page %p offset %d: %d\n", a, (int)(p - a), *p);
+        panic("kalloc: free page written");
+      }
+    }
+  }
+#endif
+}
+
 void
 kinit()
 {
+  int i;
+
   initlock(&kmem.lock, "kmem");
+  for(i = 0; i < NCPU; i++)
+    initlock(&kmem.cpu[i].lock, "kmem");
+  initlock(&kmem.zeroed.lock, "kmem");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,31 +116,180 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    kmem.ref[PA2IDX(p)] = 1;
     kfree(p);
+  }
+}
+
+// Put the free block of 2^k pages at pa on free[k].
+// Caller holds kmem.lock.
+static void
+bpush(uint64 pa, int k)
+{
+  struct run *r = (struct run*)pa;
+
+  r->prev = 0;
+  r->next = kmem.free[k];
+  if(r->next)
+    r->next->prev = r;
+  kmem.free[k] = r;
+  kmem.order[PA2IDX(pa)] = 1 + k;
+}
+
+// Take the free block of 2^k pages at r off free[k].
+// Caller holds kmem.lock.
+static void
+bunlink(struct run *r, int k)
+{
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    kmem.free[k] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  kmem.order[PA2IDX(r)] = 0;
+}
+
+// Allocate a block of 2^k pages, splitting a larger one
+// if need be. Caller holds kmem.lock.
+// Returns 0 if no block is large enough.
+static uint64
+balloc(int k)
+{
+  struct run *r;
+  int j;
+
+  for(j = k; j <= MAXORDER && kmem.free[j] == 0; j++)
+    ;
+  if(j > MAXORDER)
+    return 0;
+  r = kmem.free[j];
+  bunlink(r, j);
+  // give back the upper halves.
+  while(j > k){
+    j--;
+    bpush((uint64)r + BLOCKSIZE(j), j);
+  }
+  kmem.nfree -= 1 << k;
+  return (uint64)r;
+}
+
+// Free the block of 2^k pages at pa, merging it with its
+// buddy as long as that is free. Caller holds kmem.lock.
+static void
+bfree(uint64 pa, int k)
+{
+  uint64 buddy;
+
+  kmem.nfree += 1 << k;
+  for(; k < MAXORDER; k++){
+    buddy = pa ^ BLOCKSIZE(k);
+    if(buddy < (uint64)end || buddy + BLOCKSIZE(k) > PHYSTOP ||
+       kmem.order[PA2IDX(buddy)] != 1 + k)
+      break;
+    bunlink((struct run*)buddy, k);
+    if(buddy < pa)
+      pa = buddy;
+  }
+  bpush(pa, k);
+}
+
+// Take up to n pages off f, as a chain.
+static struct run*
+take(struct freelist *f, int n)
+{
+  struct run *r, *chain;
+
+  acquire(&f->lock);
+  chain = r = f->head;
+  if(r){
+    while(--n > 0 && r->next)
+      r = r->next;
+    f->head = r->next;
+    r->next = 0;
+    for(r = chain; r; r = r->next)
+      f->n--;
+  }
+  release(&f->lock);
+  return chain;
+}
+
+// Put a chain of pages on f.
+static void
+give(struct freelist *f, struct run *chain)
+{
+  struct run *r;
+  int n;
+
+  if(chain == 0)
+    return;
+  for(n = 1, r = chain; r->next; r = r->next)
+    n++;
+  acquire(&f->lock);
+  r->next = f->head;
+  f->head = chain;
+  f->n += n;
+  release(&f->lock);
+}
+
+// Give a chain of single pages back to the buddy allocator.
+static void
+unbatch(struct run *chain)
+{
+  struct run *r;
+
+  if(chain == 0)
+    return;
+  acquire(&kmem.lock);
+  while((r = chain) != 0){
+    chain = r->next;
+    bfree((uint64)r, 0);
+  }
+  release(&kmem.lock);
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// Frees the page when that was the last reference.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct freelist *f;
+  struct run *r, *chain = 0;
+  int ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  for(;;){
+    if((ref = kmem.ref[PA2IDX(pa)]) < 1)
+      panic("kfree ref");
+    if(ref == 1)
+      break;
+    if(__sync_bool_compare_and_swap(&kmem.ref[PA2IDX(pa)], ref, ref - 1))
+      return;
+  }
+
   // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  junk(pa, PGSIZE, JUNK_FREE);
 
   r = (struct run*)pa;
+  kmem.ref[PA2IDX(pa)] = 0;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  f = &kmem.cpu[cpuid()];
+  acquire(&f->lock);
+  r->next = f->head;
+  f->head = r;
+  f->n++;
+  release(&f->lock);
+  if(f->n > CPUMAX)
+    chain = take(f, BATCH);
+  pop_off();
+  unbatch(chain);
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -67,16 +297,180 @@ kfree(void *pa)
 // Returns 0 if the memory cannot be allocated.
 void *
 kalloc(void)
+{
+  struct freelist *f;
+  struct run *r, *chain = 0;
+  uint64 pa;
+  int i, c;
+
+  push_off();
+  c = cpuid();
+  f = &kmem.cpu[c];
+  if(f->head == 0){
+    acquire(&kmem.lock);
+    for(i = 0; i < BATCH && (pa = balloc(0)) != 0; i++){
+      r = (struct run*)pa;
+      r->next = chain;
+      chain = r;
+    }
+    release(&kmem.lock);
+    for(i = 1; chain == 0 && i < NCPU; i++)
+      chain = take(&kmem.cpu[(c + i) % NCPU], (kmem.cpu[(c + i) % NCPU].n + 1) / 2);
+    give(f, chain);
+  }
+
+  acquire(&f->lock);
+  r = f->head;
+  if(r){
+    f->head = r->next;
+    f->n--;
+    kmem.ref[PA2IDX(r)] = 1;
+  }
+  release(&f->lock);
+  pop_off();
+
+  if(r){
+    checkjunk(r, PGSIZE);
+    junk(r, PGSIZE, JUNK_ALLOC);
+  } else if((r = take(&kmem.zeroed, 1)) != 0){
+    // the last free pages may all be zeroed ones.
+    kmem.ref[PA2IDX(r)] = 1;
+  }
+  return (void*)r;
+}
+
+// Allocate one page of physical memory, filled with zeros.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  // take() leaves r->next, the only word in use, zero.
+  if((r = take(&kmem.zeroed, 1)) != 0){
+    kmem.ref[PA2IDX(r)] = 1;
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
+  return (void*)r;
+}
+
+// Called by the scheduler when it finds nothing to run:
+// zero a free page for kalloc_zeroed(), unless enough are.
+// Returns 1 if it zeroed one, 0 if there was nothing to do.
+int
+kzeroidle(void)
 {
   struct run *r;
 
+  if(kmem.zeroed.n >= ZEROMAX)
+    return 0;
   acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  r = (struct run*)balloc(0);
   release(&kmem.lock);
+  if(r == 0)
+    return 0;
+  checkjunk(r, PGSIZE);
+  memset((char*)r, 0, PGSIZE);
+  give(&kmem.zeroed, r);
+  return 1;
+}
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
-  return (void*)r;
+// Allocate 2^k physically contiguous pages, aligned to
+// their size. They are ordinary pages, each with one
+// reference, so they can also be freed one by one with
+// kfree(), as megapages are. Pages cached on the CPUs'
+// free lists, and zeroed ones, are given back first if that
+// helps.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_order(int k)
+{
+  struct run *r, *chain;
+  uint64 pa, a;
+  int i;
+
+  if(k < 0 || k > MAXORDER)
+    panic("kalloc_order");
+  if(k == 0)
+    return kalloc();
+
+  acquire(&kmem.lock);
+  pa = balloc(k);
+  release(&kmem.lock);
+  if(pa == 0){
+    for(i = 0; i < NCPU; i++)
+      unbatch(take(&kmem.cpu[i], CPUMAX + BATCH));
+    chain = take(&kmem.zeroed, ZEROMAX);
+    for(r = chain; r; r = r->next)
+      junk(r + 1, PGSIZE - sizeof(*r), JUNK_FREE);
+    unbatch(chain);
+    acquire(&kmem.lock);
+    pa = balloc(k);
+    release(&kmem.lock);
+    if(pa == 0)
+      return 0;
+  }
+
+  for(a = pa; a < pa + BLOCKSIZE(k); a += PGSIZE)
+    kmem.ref[PA2IDX(a)] = 1;
+  checkjunk((void*)pa, BLOCKSIZE(k));
+  junk((void*)pa, BLOCKSIZE(k), JUNK_ALLOC);
+  return (void*)pa;
+}
+
+// Free the 2^k pages at pa, which came from kalloc_order(k)
+// and must have just one reference each.
+void
+kfree_order(void *pa, int k)
+{
+  uint64 a;
+
+  if(k < 0 || k > MAXORDER || ((uint64)pa % BLOCKSIZE(k)) != 0 ||
+     (char*)pa < end || (uint64)pa + BLOCKSIZE(k) > PHYSTOP)
+    panic("kfree_order");
+  if(k == 0){
+    kfree(pa);
+    return;
+  }
+
+  for(a = (uint64)pa; a < (uint64)pa + BLOCKSIZE(k); a += PGSIZE){
+    if(kmem.ref[PA2IDX(a)] != 1)
+      panic("kfree_order ref");
+    kmem.ref[PA2IDX(a)] = 0;
+  }
+  junk(pa, BLOCKSIZE(k), JUNK_FREE);
+
+  acquire(&kmem.lock);
+  bfree((uint64)pa, k);
+  release(&kmem.lock);
+}
+
+// Add a reference to an allocated page.
+void
+kdup(void *pa)
+{
+  if(__sync_fetch_and_add(&kmem.ref[PA2IDX(pa)], 1) < 1)
+    panic("kdup");
+}
+
+// Number of references to an allocated page.
+int
+krefcount(void *pa)
+{
+  return kmem.ref[PA2IDX(pa)];
+}
+
+// Number of free pages. Only a hint: it may be
+// stale by the time the caller looks at it.
+int
+kfreecount(void)
+{
+  int i, n;
+
+  n = kmem.nfree + kmem.zeroed.n;
+  for(i = 0; i < NCPU; i++)
+    n += kmem.cpu[i].n;
+  return n;
 }
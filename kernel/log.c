@@ -141,6 +141,24 @@ begin_op(void)
   }
 }
 
+// called before writing blocks with bwrite() instead of
+// through the log (swap files; see writeToSwapFile()), and
+// followed by end_op(). A commit copies each logged block from
+// the cache to the log and later from the log back over the
+// block, so a write to a logged block in between would be
+// lost; this waits for a commit in progress and keeps the
+// next from starting until end_op(). It reserves no log
+// space, so it can't wait on the caller's own transaction.
+void
+begin_unlogged(void)
+{
+  acquire(&log.lock);
+  while(log.committing)
+    sleep(&log, &log.lock);
+  log.outstanding += 1;
+  release(&log.lock);
+}
+
 // called at the end of each FS system call.
 // commits if this was the last outstanding operation.
 void
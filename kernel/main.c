@@ -27,8 +27,11 @@ main()
     binit();         // buffer cache
     iinit();         // inode cache
     fileinit();      // file table
+    pipeinit();      // pipe cache
     virtio_disk_init(); // emulated hard disk
+    zswapinit();     // compressed swap pool
     userinit();      // first user process
+    kthread(pageout, "pageout"); // pageout daemon
     __sync_synchronize();
     started = 1;
   } else {
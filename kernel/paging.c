@@ -0,0 +1,1030 @@
+//
+// Demand paging.
+//
+// Each process keeps at most MAX_PSYC_PAGES of its user pages
+// in RAM. When it needs another one, a victim page is written to
+// a swap slot and its PTE is changed from PTE_V to PTE_PG, with
+// the slot number kept in the PTE's physical page number field.
+// A later page fault on that address (usertrap()), or a
+// copyin()/copyout() that touches it, reads the page back in.
+//
+// An evicted page goes to the compressed swap pool in RAM
+// (zswap.c) if it compresses well and the pool has room. Its
+// slot number is then a pool entry with ZSLOT set. Otherwise
+// it goes to a slot on disk: in the disk's swap area (swap.c)
+// if mkfs made one, and otherwise in the process's own swap
+// file (see pageswapfile()). Either way a process uses at most
+// MAX_SWAP_PAGES slots on disk.
+//
+// fork() shares resident pages copy-on-write (see uvmcopy()).
+// Each sharer tracks such a page in its own ram[]; evicting it
+// stores a copy and drops that process's reference.
+//
+// If no slot is free, new pages stay resident without
+// being tracked in p->ram[]; they cannot be evicted, but the
+// process keeps running as it would without paging.
+//
+// Once every page of an aligned 2-megabyte extent of a heap is
+// resident and the process's own, the extent is copied into a
+// megapage (see walkmega() in vm.c) if memory is plentiful,
+// which saves page-table pages and TLB entries. Only densely
+// used memory is promoted, so sparse heaps cost no more than
+// the pages they touch. Megapages are resident and untracked
+// like the pages above: paging one out would cost 512 slots.
+// Their pages are split into ordinary PTEs, and stay untracked,
+// when fork() shares one and a write copies one of its pages,
+// or when sbrk() gives back part of one. Under memory pressure
+// the pageout daemon splits them too, and frees the pages that
+// hold only zeros, which read the same once unmapped.
+//
+// The replacement policy is picked at build time with
+// make SELECTION=NFUA|LAPA|SCFIFO|NONE; see victim() below.
+// NONE never evicts, which turns paging off. NFUA and LAPA rely
+// on pagetick() to age pages from the timer interrupt.
+//
+// A pageout daemon (pageout()) also evicts pages in the
+// background once free memory runs low, so a process's paging
+// state and user PTEs are protected by p->pglock. The daemon
+// unmaps another process's pages only while holding p->lock
+// and seeing that p is not RUNNING, so that no CPU is using
+// them; p reloads satp, which flushes its stale TLB entries,
+// before it runs user code again. The kernel's own accesses to
+// user memory (copyin(), copyout()) walk the page table and
+// copy with interrupts off, so they can't be preempted halfway.
+// pagetick() runs in p itself, and takes p->pglock too, but
+// skips a tick rather than wait for it.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define AGESCAN 8          // resident pages aged per clock tick
+#define MAXPIN (MAX_PSYC_PAGES/2) // most pages pinned by pagepin()
+#define PAGEOUT_LOW 256    // wake the pageout daemon below this many free pages
+#define PAGEOUT_HIGH 512   // ... and let it sleep again at this many
+#define PAGEOUT_BATCH 8    // pages it evicts from a process at a time
+#define MEGAFREE 2048      // promote to megapages only while this many pages stay free
+#define MAXZERO (2*(PHYSTOP-KERNBASE)/PGSIZE) // most zero page mappings per process
+
+extern struct proc proc[NPROC];
+extern char *zeropage;  // vm.c
+
+// A page on its way out; see evict().
+struct evicted {
+  uint64 pa;
+  struct page pg;              // its ram[] entry, in case it stays
+};
+
+// a paged-out PTE holds the swap slot where the PPN would be.
+#define SLOT2PTE(slot) (((uint64)(slot)) << 10)
+#define PTE2SLOT(pte)  ((int)((pte) >> 10))
+#define ZSLOT (1 << 30)   // slot is a zswap.c entry, not on disk
+
+// Swap I/O sleeps, which is not allowed while holding a
+// spinlock (e.g. copyout() from wait(), under wait_lock).
+static int
+cansleep(void)
+{
+  int noff;
+
+  push_off();
+  noff = mycpu()->noff;
+  pop_off();
+  return noff == 1;
+}
+
+// Allocate the lowest free slot in p's swap file, so that
+// fork() has only the slots below swaphwm to copy. swaphint skips
+// the slots known to be taken.
+// Returns the slot number, or -1 if the file is full.
+static int
+fileslotalloc(struct proc *p)
+{
+  int i, bi, m, slot;
+
+  for(i = p->swaphint / 8; i < sizeof(p->swapmap); i++){
+    if(p->swapmap[i] == 0xFF)
+      continue;
+    for(bi = 0; bi < 8; bi++){
+      m = 1 << bi;
+      if((p->swapmap[i] & m) == 0){
+        slot = i*8 + bi;
+        if(slot >= MAX_SWAP_PAGES)
+          return -1;
+        p->swapmap[i] |= m;
+        p->swaphint = slot + 1;
+        if(slot >= p->swaphwm)
+          p->swaphwm = slot + 1;
+        return slot;
+      }
+    }
+  }
+  return -1;
+}
+
+static void
+fileslotfree(struct proc *p, int slot)
+{
+  int m = 1 << (slot % 8);
+
+  if(slot < 0 || slot >= MAX_SWAP_PAGES || (p->swapmap[slot/8] & m) == 0)
+    panic("slotfree");
+  p->swapmap[slot/8] &= ~m;
+  if(slot < p->swaphint)
+    p->swaphint = slot;
+}
+
+// Allocate a swap slot for p.
+// Returns the slot number, or -1 if none is free.
+static int
+slotalloc(struct proc *p)
+{
+  int slot;
+
+  if(p->nswap >= MAX_SWAP_PAGES)
+    return -1;
+  if(swaparea())
+    slot = swapalloc();
+  else
+    slot = fileslotalloc(p);
+  if(slot >= 0)
+    p->nswap++;
+  return slot;
+}
+
+static void
+slotfree(struct proc *p, int slot)
+{
+  if(slot & ZSLOT){
+    zswapfree(slot & ~ZSLOT);
+    p->nzswap--;
+    return;
+  }
+  if(swaparea())
+    swapfree(slot);
+  else
+    fileslotfree(p, slot);
+  p->nswap--;
+}
+
+// Write the page at pa to slot.
+// Returns 0 on success, -1 on error.
+static int
+slotwrite(struct proc *p, int slot, char *pa)
+{
+  if(swaparea()){
+    swaprw(slot, &pa, 1, 1);
+    return 0;
+  }
+  // see pageswapfile() for why there may be no file.
+  if(p->swapFile == 0)
+    return -1;
+  if(writeToSwapFile(p, pa, slot*PGSIZE, PGSIZE) != PGSIZE)
+    return -1;
+  return 0;
+}
+
+// Read slot into the page at pa.
+// Returns 0 on success, -1 on error.
+static int
+slotread(struct proc *p, int slot, char *pa)
+{
+  if(slot & ZSLOT){
+    zswapload(slot & ~ZSLOT, pa);
+    return 0;
+  }
+  if(swaparea()){
+    swaprw(slot, &pa, 1, 0);
+    return 0;
+  }
+  if(readFromSwapFile(p, pa, slot*PGSIZE, PGSIZE) != PGSIZE)
+    return -1;
+  return 0;
+}
+
+#ifdef SELECTION_LAPA
+#define AGE_INIT 0xFFFFFFFF
+#else
+#define AGE_INIT 0
+#endif
+
+// Start tracking resident user page va, if there is room.
+// Returns its ram[] entry, or 0.
+static struct page*
+pagetrack(struct proc *p, uint64 va)
+{
+  struct page *pg;
+
+  for(pg = p->ram; pg < &p->ram[MAX_PSYC_PAGES]; pg++){
+    if(!pg->used){
+      pg->used = 1;
+      pg->va = va;
+      pg->seq = p->pageseq++;
+      pg->age = AGE_INIT;
+      pg->ra = 0;
+      p->nram++;
+      return pg;
+    }
+  }
+  return 0;
+}
+
+// Adapt p's readahead window to what became of a page that
+// was read ahead: grow it if the page was used, and halve it
+// if the page is being evicted unused.
+static void
+raseen(struct proc *p, struct page *pg, int used)
+{
+  if(!pg->ra)
+    return;
+  pg->ra = 0;
+  if(!used)
+    p->rawin /= 2;
+  else if(p->rawin < MAXREADAHEAD)
+    p->rawin++;
+}
+
+#if defined(SELECTION_NFUA) || defined(SELECTION_LAPA) || defined(SELECTION_SCFIFO)
+// Pages pinned by pagepin() for the current system call
+// are not evicted.
+static int
+evictable(struct proc *p, struct page *pg)
+{
+  return pg->used &&
+    (pg->va + PGSIZE <= p->pinva || pg->va >= p->pinva + p->pinsz);
+}
+#endif
+
+// Choose which resident page to evict, or return 0 if none.
+#if defined(SELECTION_NFUA)
+
+// Not frequently used, with aging: the lowest age.
+static struct page*
+victim(struct proc *p)
+{
+  struct page *pg, *v = 0;
+
+  for(pg = p->ram; pg < &p->ram[MAX_PSYC_PAGES]; pg++){
+    if(evictable(p, pg) && (v == 0 || pg->age < v->age))
+      v = pg;
+  }
+  return v;
+}
+
+#elif defined(SELECTION_LAPA)
+
+static int
+nbits(uint x)
+{
+  int n;
+
+  for(n = 0; x; x &= x - 1)
+    n++;
+  return n;
+}
+
+// Least accessed page, with aging: the fewest 1 bits in its
+// age, breaking ties by the lowest age.
+static struct page*
+victim(struct proc *p)
+{
+  struct page *pg, *v = 0;
+  int n, vn = 0;
+
+  for(pg = p->ram; pg < &p->ram[MAX_PSYC_PAGES]; pg++){
+    if(!evictable(p, pg))
+      continue;
+    n = nbits(pg->age);
+    if(v == 0 || n < vn || (n == vn && pg->age < v->age)){
+      v = pg;
+      vn = n;
+    }
+  }
+  return v;
+}
+
+#elif defined(SELECTION_SCFIFO)
+
+// The evictable page that has been resident the longest.
+static struct page*
+oldest(struct proc *p)
+{
+  struct page *pg, *v = 0;
+
+  for(pg = p->ram; pg < &p->ram[MAX_PSYC_PAGES]; pg++){
+    if(evictable(p, pg) && (v == 0 || pg->seq < v->seq))
+      v = pg;
+  }
+  return v;
+}
+
+// Second-chance FIFO: the oldest page, unless it has been
+// accessed since it was last considered, in which case it
+// goes to the back of the queue.
+static struct page*
+victim(struct proc *p)
+{
+  struct page *v;
+  pte_t *pte;
+
+  while((v = oldest(p)) != 0){
+    pte = walk(p->pagetable, v->va, 0);
+    if((*pte & PTE_A) == 0)
+      break;
+    raseen(p, v, 1);
+    *pte &= ~PTE_A;
+    v->seq = p->pageseq++;
+  }
+  return v;
+}
+
+#else
+
+// SELECTION_NONE: never evict.
+static struct page*
+victim(struct proc *p)
+{
+  return 0;
+}
+
+#endif
+
+// Choose a page of p to evict, and mark its PTE paged out;
+// the caller then finishes with evictdone().
+// Doesn't sleep. Returns 0, or -1 if nothing can be evicted.
+static int
+evict(struct proc *p, struct evicted *e)
+{
+  struct page *pg;
+  pte_t *pte;
+
+  if((pg = victim(p)) == 0)
+    return -1;
+
+  pte = walk(p->pagetable, pg->va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0)
+    panic("evict");
+  raseen(p, pg, (*pte & PTE_A) != 0);
+  e->pa = PTE2PA(*pte);
+  e->pg = *pg;
+  *pte = (PTE_FLAGS(*pte) & ~(PTE_V|PTE_A|PTE_D)) | PTE_PG;
+  pg->used = 0;
+  p->nram--;
+  return 0;
+}
+
+// Store an evicted page, compressed in RAM if possible or
+// else in a slot on disk, and free it; or put it back if
+// neither works. p can't touch the page meanwhile: a fault
+// on it waits for p->pglock in pagefault().
+// Returns 0 on success, -1 on failure.
+static int
+evictdone(struct proc *p, struct evicted *e)
+{
+  struct page *pg;
+  pte_t *pte;
+  int slot;
+
+  pte = walk(p->pagetable, e->pg.va, 0);
+  if((slot = zswapstore((char*)e->pa)) >= 0){
+    slot |= ZSLOT;
+    p->nzswap++;
+  } else if((slot = slotalloc(p)) >= 0 &&
+            slotwrite(p, slot, (char*)e->pa) < 0){
+    slotfree(p, slot);
+    slot = -1;
+  }
+
+  if(slot < 0){
+    *pte = PA2PTE(e->pa) | (PTE_FLAGS(*pte) & ~PTE_PG) | PTE_V;
+    if((pg = pagetrack(p, e->pg.va)) != 0)
+      *pg = e->pg;
+    return -1;
+  }
+  *pte = SLOT2PTE(slot) | PTE_FLAGS(*pte);
+  kfree((void*)e->pa);
+  return 0;
+}
+
+// Evict one of the current process p's resident pages.
+// Caller holds p->pglock.
+// Returns 0 on success, -1 if nothing could be evicted.
+static int
+swapout(struct proc *p)
+{
+  struct evicted e;
+
+  if(!cansleep() || evict(p, &e) < 0)
+    return -1;
+  sfence_vma();
+  return evictdone(p, &e);
+}
+
+// How many of the pages after va to read in along with it:
+// up to p->rawin pages that are paged out to disk, to
+// consecutive slots if in the swap area, and that fit in the
+// resident set without evicting anything else.
+static int
+readahead(struct proc *p, uint64 va, int slot)
+{
+  pte_t *pte;
+  int n, max;
+
+  // compressed pages are cheap to fault in one at a time.
+  if(slot & ZSLOT)
+    return 0;
+
+  max = MAX_PSYC_PAGES - p->nram - 1;
+  if(max > p->rawin)
+    max = p->rawin;
+  for(n = 0; n < max; n++){
+    va += PGSIZE;
+    if(va >= p->sz)
+      break;
+    if((pte = walk(p->pagetable, va, 0)) == 0 || (*pte & PTE_PG) == 0)
+      break;
+    if((PTE2SLOT(*pte) & ZSLOT) ||
+       (swaparea() && PTE2SLOT(*pte) != slot + n + 1))
+      break;
+  }
+  return n;
+}
+
+// Read p's page at va back in, along with the paged-out pages
+// that follow it if p's recent faults suggest it will touch
+// them next. Those are installed as resident but not accessed,
+// and adjust p->rawin by whether they turn out to be used.
+// Caller holds p->pglock.
+// Returns 0 on success, -1 if va is not paged out
+// or the page could not be read.
+static int
+pagein(struct proc *p, uint64 va)
+{
+  char *mem[1 + MAXREADAHEAD];
+  pte_t *pte;
+  struct page *pg;
+  int i, n, slot;
+
+  va = PGROUNDDOWN(va);
+  if(va >= p->sz)
+    return -1;
+  if((pte = walk(p->pagetable, va, 0)) == 0 || (*pte & PTE_PG) == 0)
+    return -1;
+
+  // a fault on the page after the last one is a sequential
+  // sweep, even if nothing was read ahead for it.
+  if(va == p->lastfault + PGSIZE && p->rawin < MAXREADAHEAD)
+    p->rawin++;
+  p->lastfault = va;
+
+  if(p->nram >= MAX_PSYC_PAGES)
+    swapout(p);
+
+  // under memory pressure, make room by evicting one of our own.
+  if((mem[0] = kalloc()) == 0 && (swapout(p) < 0 || (mem[0] = kalloc()) == 0))
+    return -1;
+  slot = PTE2SLOT(*pte);
+  n = 1 + readahead(p, va, slot);
+  for(i = 1; i < n; i++){
+    if((mem[i] = kalloc()) == 0)
+      break;
+  }
+  n = i;
+
+  if(swaparea() && (slot & ZSLOT) == 0){
+    swaprw(slot, mem, n, 0);
+  } else {
+    for(i = 0; i < n; i++){
+      pte = walk(p->pagetable, va + i*PGSIZE, 0);
+      if(slotread(p, PTE2SLOT(*pte), mem[i]) < 0)
+        break;
+    }
+    while(n > i)
+      kfree(mem[--n]);
+    if(n == 0)
+      return -1;
+  }
+
+  for(i = 0; i < n; i++){
+    pte = walk(p->pagetable, va + i*PGSIZE, 0);
+    slotfree(p, PTE2SLOT(*pte));
+    *pte = PA2PTE(mem[i]) | (PTE_FLAGS(*pte) & ~PTE_PG) | PTE_V;
+    pg = pagetrack(p, va + i*PGSIZE);
+    if(i > 0 && pg){
+      pg->age = 0;
+      pg->ra = 1;
+    }
+  }
+  return 0;
+}
+
+// Replace the aligned MEGAPGSIZE extent around va with a
+// megapage, if all of it is resident and p's own and memory is
+// plentiful. Its pages are no longer tracked in ram[].
+static void
+megapromote(struct proc *p, uint64 va)
+{
+  struct page *pg;
+
+  va = MEGAPGROUNDDOWN(va);
+  if(va + MEGAPGSIZE > p->sz || kfreecount() < MEGAFREE + MEGAPGSIZE/PGSIZE)
+    return;
+  if(uvmmerge(p->pagetable, va) < 0)
+    return;
+  sfence_vma();
+  p->nmega++;
+  for(pg = p->ram; pg < &p->ram[MAX_PSYC_PAGES]; pg++){
+    if(pg->used && pg->va >= va && pg->va < va + MEGAPGSIZE){
+      pg->used = 0;
+      p->nram--;
+    }
+  }
+}
+
+// Make the current process p's page at va accessible, if it
+// can be: map it if it was never touched, read it back
+// in if it is paged out, and if write,
+// give p its own copy if it is shared copy-on-write.
+// Caller holds p->pglock.
+// Returns 0 on success, -1 if the access is not allowed
+// or there is no memory for it.
+static int
+pagefix(struct proc *p, uint64 va, int write)
+{
+  pte_t *pte;
+
+  va = PGROUNDDOWN(va);
+  if(va >= p->sz)
+    return -1;
+  // walk() finds no level-0 table if nothing near va has
+  // been touched, or if va is in a megapage.
+  if((pte = walk(p->pagetable, va, 0)) == 0)
+    pte = walkmega(p->pagetable, va);
+
+  // a page that has only been read maps the zero page,
+  // until the first write gives it a page of its own.
+  if(write && pte && (*pte & PTE_V) && PTE2PA(*pte) == (uint64)zeropage){
+    kfree(zeropage);
+    *pte = 0;
+    p->nzero--;
+  }
+
+  // the first touch of a page that sbrk() allocated lazily.
+  // a read maps the zero page, which is not tracked in ram[]
+  // since it costs no memory, up to MAXZERO pages; beyond
+  // that, reading untouched memory costs memory as writing
+  // it does, so a process can't map unbounded amounts of it
+  // (or page-table pages for it) for free. a write gets a
+  // zeroed page, evicting another if need be, and may
+  // complete a megapage.
+  if(pte == 0 || *pte == 0){
+    if(!write && p->nzero < MAXZERO){
+      if(mappages(p->pagetable, va, PGSIZE, (uint64)zeropage,
+                  PTE_R|PTE_X|PTE_U|PTE_COW) != 0)
+        return -1;
+      kdup(zeropage);
+      p->nzero++;
+      return 0;
+    }
+    if(p->nram >= MAX_PSYC_PAGES)
+      swapout(p);
+    if(uvmalloc(p->pagetable, va, va + PGSIZE) == 0 &&
+       (swapout(p) < 0 || uvmalloc(p->pagetable, va, va + PGSIZE) == 0))
+      return -1;
+    pagetrack(p, va);
+    megapromote(p, va);
+    return 0;
+  }
+
+  if((*pte & PTE_U) == 0)
+    return -1;
+  if((*pte & PTE_PG) && pagein(p, va) < 0)
+    return -1;
+  if(write){
+    if((*pte & (PTE_W|PTE_COW)) == 0)
+      return -1;
+    while(uvmcow(p->pagetable, va) == 0){
+      if(swapout(p) < 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+// Handle a page fault by the current process p at va, or a
+// copyin()/copyout() that found va inaccessible.
+// Returns 0 if the access can be retried, -1 if not.
+int
+pagefault(struct proc *p, uint64 va, int write)
+{
+  int r;
+
+  if(!cansleep())
+    return -1;
+  acquiresleep(&p->pglock);
+  r = pagefix(p, va, write);
+  releasesleep(&p->pglock);
+  return r;
+}
+
+// Called on each clock tick that interrupts p in user space.
+// Shifts the PTE_A bit of the next AGESCAN resident pages into
+// the top of their ages, and clears it so that the next pass
+// sees only new accesses. Starting where the last tick left off
+// keeps the cost per tick bounded, while every page is still
+// aged once per MAX_PSYC_PAGES/AGESCAN ticks. If the pageout
+// daemon holds p->pglock, evicting p's pages and changing
+// ram[], the pages are left for the next tick.
+void
+pagetick(struct proc *p)
+{
+#if defined(SELECTION_NFUA) || defined(SELECTION_LAPA)
+  struct page *pg;
+  pte_t *pte;
+  int i, cleared = 0;
+
+  if(!tryacquiresleep(&p->pglock))
+    return;
+  for(i = 0; i < AGESCAN && i < MAX_PSYC_PAGES; i++){
+    pg = &p->ram[p->agehand];
+    p->agehand = (p->agehand + 1) % MAX_PSYC_PAGES;
+    if(!pg->used || (pte = walk(p->pagetable, pg->va, 0)) == 0)
+      continue;
+    pg->age >>= 1;
+    if(*pte & PTE_A){
+      raseen(p, pg, 1);
+      pg->age |= 1U << 31;
+      *pte &= ~PTE_A;
+      cleared = 1;
+    }
+  }
+
+  // drop cached translations that still say PTE_A is set,
+  // so that the next access sets it again.
+  if(cleared)
+    sfence_vma();
+  releasesleep(&p->pglock);
+#endif
+}
+
+// Make the user pages in [va, va+n) resident, and writable too
+// if write, and keep them so until the current system call
+// returns, so that copyin() and copyout() under a spinlock
+// won't need to page them in. Only the first MAXPIN pages are
+// pinned, leaving the rest of the resident set to be evicted;
+// code that copies more than that (pipes, files) does so
+// without holding a spinlock.
+void
+pagepin(struct proc *p, uint64 va, uint64 n, int write)
+{
+  uint64 a;
+
+  if(n == 0 || va >= p->sz)
+    return;
+  if(va + n > p->sz || va + n < va)
+    n = p->sz - va;
+  if(n > MAXPIN*PGSIZE - va % PGSIZE)
+    n = MAXPIN*PGSIZE - va % PGSIZE;
+
+  acquiresleep(&p->pglock);
+  p->pinva = va;
+  p->pinsz = n;
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE)
+    pagefix(p, a, write);
+  releasesleep(&p->pglock);
+}
+
+// Shrink p from oldsz to newsz. Caller holds p->pglock.
+// Returns the new size, or oldsz if out of memory.
+static uint64
+shrink(struct proc *p, uint64 oldsz, uint64 newsz)
+{
+  struct page *pg;
+  pte_t *pte;
+  uint64 a;
+
+  if(newsz >= oldsz)
+    return oldsz;
+
+  // uvmunmap() only removes whole megapages.
+  a = PGROUNDUP(newsz);
+  if(a % MEGAPGSIZE != 0 && uvmsplit(p->pagetable, a) < 0 &&
+     (swapout(p) < 0 || uvmsplit(p->pagetable, a) < 0))
+    return oldsz;
+
+  for(pg = p->ram; pg < &p->ram[MAX_PSYC_PAGES]; pg++){
+    if(pg->used && pg->va >= PGROUNDUP(newsz) && pg->va < PGROUNDUP(oldsz)){
+      pg->used = 0;
+      p->nram--;
+    }
+  }
+  for(a = PGROUNDUP(newsz); a < PGROUNDUP(oldsz); a += PGSIZE){
+    if((pte = walk(p->pagetable, a, 0)) == 0)
+      continue;
+    if(*pte & PTE_PG)
+      slotfree(p, PTE2SLOT(*pte));
+    else if((*pte & PTE_V) && PTE2PA(*pte) == (uint64)zeropage)
+      p->nzero--;
+  }
+  return uvmdealloc(p->pagetable, oldsz, newsz);
+}
+
+// Like uvmdealloc(), but also releases the paging state
+// of the pages being removed. Returns oldsz if a megapage
+// had to be split and there was no memory for it.
+uint64
+pagedealloc(struct proc *p, uint64 oldsz, uint64 newsz)
+{
+  acquiresleep(&p->pglock);
+  newsz = shrink(p, oldsz, newsz);
+  releasesleep(&p->pglock);
+  return newsz;
+}
+
+// Release the swap slots held by paged-out pages in
+// pagetable, which is about to be freed: p's old image in
+// exec(), which holds p->pglock, or p itself when it is
+// freed and can no longer run.
+void
+pagefree(struct proc *p, pagetable_t pagetable, uint64 sz)
+{
+  pte_t *pte;
+  uint64 va;
+
+  if(p->nswap == 0 && p->nzswap == 0)
+    return;
+  for(va = 0; va < sz; va += PGSIZE){
+    if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_PG))
+      slotfree(p, PTE2SLOT(*pte));
+  }
+}
+
+// Give p a swap file, if there is no swap area, p has none,
+// and p is too big to keep all of its pages in ram[]. Other
+// processes do without one: what they can't evict to the
+// compressed pool stays resident.
+// The file is created at its full size, since allocating its
+// blocks goes through the log, and swapout() may be called in
+// the middle of a file system transaction (e.g. write() from a
+// paged-out buffer), where a nested begin_op() could wait
+// forever for log space. So this is called only where p isn't
+// in a transaction: by sbrk() and exec(). fork() makes one for
+// the child, too, if it has pages to copy into it.
+// Caller holds p->pglock.
+void
+pageswapfile(struct proc *p)
+{
+  if(swaparea() || p->swapFile || p->sz <= MAX_PSYC_PAGES*PGSIZE)
+    return;
+  // if it can't be made, p does without.
+  createSwapFile(p);
+}
+
+// Called by exec() once p has its new image, and the old
+// one's slots have been released by pagefree(): start tracking
+// the new pages, and evict whatever exceeds the limit.
+// Caller holds p->pglock.
+void
+pageexec(struct proc *p)
+{
+  pte_t *pte;
+  uint64 va;
+
+  pageswapfile(p);
+  memset(p->ram, 0, sizeof(p->ram));
+  p->nram = 0;
+  p->nzero = 0;
+  p->nmega = 0;
+
+  for(va = 0; va < p->sz; va += PGSIZE){
+    // skip the stack guard page, which user code can't touch.
+    if((pte = walk(p->pagetable, va, 0)) == 0 || (*pte & PTE_U) == 0)
+      continue;
+    if(p->nram >= MAX_PSYC_PAGES)
+      swapout(p);
+    pagetrack(p, va);
+  }
+}
+
+// Give child np a copy of parent p's paging state. uvmcopy()
+// has already copied the page table, including the paged-out
+// PTEs, so the child starts with the same pages resident and
+// paged out, and none of them is brought into memory.
+// Parent and child share compressed pages, and slots in the
+// swap area, none of which is changed while in use. A swap
+// file is copied block by block on disk, if it holds pages;
+// otherwise the child gets its own on its next sbrk() or
+// exec().
+// Caller holds p->pglock, and has held it since uvmcopy().
+// Returns 0 on success, -1 on failure.
+int
+pagefork(struct proc *p, struct proc *np)
+{
+  pte_t *pte;
+  uint64 va;
+
+  memmove(np->ram, p->ram, sizeof(p->ram));
+  memmove(np->swapmap, p->swapmap, sizeof(p->swapmap));
+  np->swaphint = p->swaphint;
+  np->nram = p->nram;
+  np->nswap = p->nswap;
+  np->pageseq = p->pageseq;
+  np->rawin = p->rawin;
+  np->nzswap = p->nzswap;
+  np->nzero = p->nzero;
+  np->nmega = p->nmega;
+  if(p->nswap == 0 && p->nzswap == 0)
+    return 0;
+
+  for(va = 0; va < p->sz; va += PGSIZE){
+    if((pte = walk(p->pagetable, va, 0)) == 0 || (*pte & PTE_PG) == 0)
+      continue;
+    if(PTE2SLOT(*pte) & ZSLOT)
+      zswapdup(PTE2SLOT(*pte) & ~ZSLOT);
+    else if(swaparea())
+      swapdup(PTE2SLOT(*pte));
+  }
+  if(swaparea() || p->nswap == 0)
+    return 0;
+
+  // every slot below the high-water mark, free or not, in
+  // one pass.
+  if(createSwapFile(np) < 0)
+    return -1;
+  if(copySwapFile(p, np, p->swaphwm*PGSIZE) < 0){
+    removeSwapFile(np);
+    np->swapFile = 0;
+    return -1;
+  }
+  np->swaphwm = p->swaphwm;
+  return 0;
+}
+
+// The process with the most resident pages, not counting
+// those the pageout daemon has given up on, or 0 if none.
+static struct proc*
+heaviest(char *tried)
+{
+  struct proc *p, *v = 0;
+
+  // nram is read without locks; a stale value only
+  // makes for a worse choice.
+  for(p = proc; p < &proc[NPROC]; p++){
+    if(!tried[p - proc] && p->nram > 0 && (v == 0 || p->nram > v->nram))
+      v = p;
+  }
+  return v;
+}
+
+// Evict up to PAGEOUT_BATCH pages of p, if it isn't running.
+// The PTEs are changed under p->lock, which keeps p from being
+// scheduled, but the pages are written out after releasing it.
+// Returns the number of pages evicted.
+static int
+pageoutproc(struct proc *p)
+{
+  struct evicted e[PAGEOUT_BATCH];
+  int i, n = 0, done = 0;
+
+  acquiresleep(&p->pglock);
+  acquire(&p->lock);
+  if(p->state == SLEEPING || p->state == RUNNABLE){
+    while(n < PAGEOUT_BATCH && evict(p, &e[n]) == 0)
+      n++;
+  }
+  release(&p->lock);
+  for(i = 0; i < n; i++){
+    if(evictdone(p, &e[i]) == 0)
+      done++;
+  }
+  releasesleep(&p->pglock);
+  return done;
+}
+
+// Does the page at pa hold only zeros?
+static int
+zeroed(char *pa)
+{
+  uint64 *w;
+
+  for(w = (uint64*)pa; w < (uint64*)(pa + PGSIZE); w++){
+    if(*w)
+      return 0;
+  }
+  return 1;
+}
+
+// Split p's megapages that have pages holding only zeros, and
+// unmap and free those pages: a page that is not mapped reads
+// as zeros again when p next touches it. A megapage is split,
+// and a page checked and freed, under p->lock while p is not
+// RUNNING, since p's copyout() changes megapage PTEs in
+// uvmcow() without p->pglock, and could write to the page.
+// Pages pinned by pagepin() are left alone.
+// Returns the number of pages freed.
+static int
+megareclaim(struct proc *p)
+{
+  pte_t *pte, mega;
+  uint64 va, a;
+  int n = 0, nmega = 0, live, split;
+
+  // once p has run, its page table stays until exit() has
+  // set nmega to 0 under p->pglock.
+  acquiresleep(&p->pglock);
+  acquire(&p->lock);
+  live = p->state == SLEEPING || p->state == RUNNABLE || p->state == RUNNING;
+  release(&p->lock);
+  if(!live || p->nmega == 0){
+    releasesleep(&p->pglock);
+    return 0;
+  }
+
+  for(va = 0; va < p->sz; va += MEGAPGSIZE){
+    if((pte = walkmega(p->pagetable, va)) == 0)
+      continue;
+    // an unlocked first look, so as not to split for nothing.
+    // p may split the megapage meanwhile, but its pages stay
+    // allocated while we hold p->pglock.
+    mega = *pte;
+    if(!PTE_LEAF(mega))
+      continue;
+    for(a = 0; a < MEGAPGSIZE && !zeroed((char*)PTE2PA(mega) + a); a += PGSIZE)
+      ;
+    acquire(&p->lock);
+    split = a < MEGAPGSIZE && p->state != RUNNING &&
+      uvmsplit(p->pagetable, va) == 0;
+    release(&p->lock);
+    if(!split){
+      nmega++;
+      continue;
+    }
+    for(a = va; a < va + MEGAPGSIZE; a += PGSIZE){
+      if(a + PGSIZE > p->pinva && a < p->pinva + p->pinsz)
+        continue;
+      pte = walk(p->pagetable, a, 0);
+      acquire(&p->lock);
+      if(p->state != RUNNING && pte && (*pte & PTE_V) &&
+         zeroed((char*)PTE2PA(*pte))){
+        kfree((void*)PTE2PA(*pte));
+        *pte = 0;
+        n++;
+      }
+      release(&p->lock);
+    }
+  }
+  p->nmega = nmega;
+  releasesleep(&p->pglock);
+  return n;
+}
+
+static char pageoutchan;   // the pageout daemon sleeps on this
+
+// The pageout daemon, a kernel thread started by main().
+// When a clock tick finds fewer than PAGEOUT_LOW free pages, it
+// frees the zero-filled pages of megapages, and then evicts
+// batches of pages from the processes with the most resident
+// pages, until PAGEOUT_HIGH pages are free or nothing more can
+// be evicted. A process that needs a page then seldom has to
+// wait for an eviction of its own.
+void
+pageout(void)
+{
+  char tried[NPROC];
+  struct proc *p;
+
+  for(;;){
+    // nmega is read without locks, as nram is in heaviest().
+    for(p = proc; p < &proc[NPROC] && kfreecount() < PAGEOUT_HIGH; p++){
+      if(p->nmega > 0)
+        megareclaim(p);
+    }
+
+    memset(tried, 0, sizeof(tried));
+    while(kfreecount() < PAGEOUT_HIGH && (p = heaviest(tried)) != 0){
+      if(pageoutproc(p) < PAGEOUT_BATCH)
+        tried[p - proc] = 1;
+    }
+
+    acquire(&tickslock);
+    do
+      sleep(&pageoutchan, &tickslock);
+    while(kfreecount() >= PAGEOUT_LOW);
+    release(&tickslock);
+  }
+}
+
+// Called by clockintr(), with tickslock held, on each tick of
+// a CPU that isn't idle; only running processes use up memory.
+void
+pageoutkick(void)
+{
+  if(kfreecount() < PAGEOUT_LOW)
+    wakeup(&pageoutchan);
+}
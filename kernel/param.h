@@ -1,7 +1,7 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
+#define NPRIO         3  // scheduling priority levels
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
@@ -9,5 +9,12 @@
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define FSSIZE       6000  // size of file system in blocks (incl. swap files)
 #define MAXPATH      128   // maximum file path name
+#define MAX_PSYC_PAGES 16  // max resident user pages per process
+#define MAX_SWAP_PAGES 16  // max pages in a process's swap file
+#ifndef SWAPSIZE
+#define SWAPSIZE     (NPROC*MAX_SWAP_PAGES*4) // blocks of swap area; 0 for swap files
+#endif
+#define MAXREADAHEAD 4     // most pages read ahead on a page fault; 0 for none
+#define ZSWAPPAGES   64    // pages of RAM for compressed swap; 0 keeps only same-filled pages
@@ -3,12 +3,13 @@
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "fs.h"
-#include "sleeplock.h"
 #include "file.h"
 
 #define PIPESIZE 512
+#define PIPECHUNK 128   // bytes copied to or from user space at a time
 
 struct pipe {
   struct spinlock lock;
@@ -17,8 +18,17 @@ struct pipe {
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int reading;    // a piperead() is under way
 };
 
+struct kmem_cache *pipecache;
+
+void
+pipeinit(void)
+{
+  pipecache = kmem_cache_create("pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,12 +38,13 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kmem_cache_alloc(pipecache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->reading = 0;
   initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -47,7 +58,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmem_cache_free(pipecache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,36 +79,55 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kmem_cache_free(pipecache, pi);
   } else
     release(&pi->lock);
 }
 
+// How many bytes of the user buffer at addr, n bytes long,
+// to copy at once. The user's buffer is copied without
+// pi->lock held, so that copyin() and copyout() can page it
+// in, through a kernel buffer of PIPECHUNK bytes. A chunk
+// doesn't cross a page boundary, so it is copied whole or
+// not at all.
+static int
+chunk(uint64 addr, int n)
+{
+  int m = PGSIZE - addr % PGSIZE;
+
+  if(m > PIPECHUNK)
+    m = PIPECHUNK;
+  return n < m ? n : m;
+}
+
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
-  int i = 0;
+  int i = 0, j, m;
   struct proc *pr = myproc();
+  char buf[PIPECHUNK];
 
-  acquire(&pi->lock);
   while(i < n){
-    if(pi->readopen == 0 || pr->killed){
-      release(&pi->lock);
-      return -1;
-    }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
-      sleep(&pi->nwrite, &pi->lock);
-    } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
-        break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+    m = chunk(addr + i, n - i);
+    if(copyin(pr->pagetable, buf, addr + i, m) == -1)
+      break;
+    acquire(&pi->lock);
+    for(j = 0; j < m; ){
+      if(pi->readopen == 0 || pr->killed){
+        release(&pi->lock);
+        return -1;
+      }
+      if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
+        wakeup(&pi->nread);
+        sleep(&pi->nwrite, &pi->lock);
+      } else {
+        pi->data[pi->nwrite++ % PIPESIZE] = buf[j++];
+      }
     }
+    wakeup(&pi->nread);
+    release(&pi->lock);
+    i += m;
   }
-  wakeup(&pi->nread);
-  release(&pi->lock);
 
   return i;
 }
@@ -105,26 +135,51 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i, j, m;
   struct proc *pr = myproc();
-  char ch;
+  char buf[PIPECHUNK];
 
+  // a chunk is taken off the pipe only once it has been
+  // copied out, so that none is lost if copyout() fails; so
+  // only one reader at a time may be copying.
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+  while(pi->reading){
     if(pr->killed){
       release(&pi->lock);
       return -1;
     }
+    sleep(&pi->reading, &pi->lock);
+  }
+  pi->reading = 1;
+  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+    if(pr->killed){
+      i = -1;
+      goto done;
+    }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
+  for(i = 0; i < n; i += m){  //DOC: piperead-copy
+    m = chunk(addr + i, n - i);
+    if(m > pi->nwrite - pi->nread)
+      m = pi->nwrite - pi->nread;
+    if(m == 0)
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    for(j = 0; j < m; j++)
+      buf[j] = pi->data[(pi->nread + j) % PIPESIZE];
+    release(&pi->lock);
+    if(copyout(pr->pagetable, addr + i, buf, m) == -1){
+      if(i == 0)
+        i = -1;
+      acquire(&pi->lock);
       break;
+    }
+    acquire(&pi->lock);
+    pi->nread += m;
+    wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+done:
+  pi->reading = 0;
+  wakeup(&pi->reading);
   release(&pi->lock);
   return i;
 }
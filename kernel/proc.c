@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 
@@ -12,11 +13,53 @@ struct proc proc[NPROC];
 
 struct proc *initproc;
 
+// Each CPU has a queue of RUNNABLE processes, from which it
+// picks the next one to run; a CPU whose queue is empty steals
+// from the longest. A process joins the queue of the CPU it
+// last ran on. The lock order is p->lock, then a queue's lock.
+//
+// Queues are multilevel feedback queues: a FIFO per priority
+// level, the highest level first. A process that runs for its
+// level's whole quantum drops a level, and one that sleeps
+// rises a level, so that interactive processes stay ahead of
+// CPU-bound ones. So that the lowest levels don't starve, every
+// BOOSTTICKS all processes go back to their nice level.
+#define QUANTUM(prio) (1 << (prio))   // clock ticks
+#define BOOSTTICKS 50
+
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int n;                       // number of processes queued
+  uint epoch;                  // boost period last boosted in
+} runq[NCPU];
+
+// Sleeping processes are kept on sleep queues, hashed by
+// the channel they sleep on, so that wakeup() need only look
+// at the processes that might be sleeping on its channel.
+// The lock order is a sleep queue's lock, then p->lock.
+#define NSLEEPQ 64
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+} sleepq[NSLEEPQ];
+
+static struct sleepq*
+chanq(void *chan)
+{
+  return &sleepq[((uint64)chan * 0x9E3779B97F4A7C15UL) >> 58];
+}
+
 int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadret(void);
 static void freeproc(struct proc *p);
+static void setrunnable(struct proc *p);
+static void kick(int id);
+static void enqueue(struct runq *q, struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
@@ -47,11 +90,18 @@ void
 procinit(void)
 {
   struct proc *p;
-  
+  struct runq *q;
+  struct sleepq *sq;
+
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(q = runq; q < &runq[NCPU]; q++)
+    initlock(&q->lock, "runq");
+  for(sq = sleepq; sq < &sleepq[NSLEEPQ]; sq++)
+    initlock(&sq->lock, "sleepq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
+      initsleeplock(&p->pglock, "paging");
       p->kstack = KSTACK((int) (p - proc));
   }
 }
@@ -119,6 +169,11 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->cpu = cpuid();
+  p->nice = 0;
+  p->prio = 0;
+  p->used = 0;
+  p->epoch = ticks / BOOSTTICKS;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -153,8 +208,10 @@ freeproc(struct proc *p)
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
+  if(p->pagetable){
+    pagefree(p, p->pagetable, p->sz);
     proc_freepagetable(p->pagetable, p->sz);
+  }
   p->pagetable = 0;
   p->sz = 0;
   p->pid = 0;
@@ -163,6 +220,22 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfunc = 0;
+  p->pinsz = 0;
+  p->swapFile = 0;
+  memset(p->ram, 0, sizeof(p->ram));
+  memset(p->swapmap, 0, sizeof(p->swapmap));
+  p->swaphint = 0;
+  p->swaphwm = 0;
+  p->nram = 0;
+  p->nswap = 0;
+  p->nzswap = 0;
+  p->nzero = 0;
+  p->nmega = 0;
+  p->pageseq = 0;
+  p->agehand = 0;
+  p->rawin = 0;
+  p->lastfault = 0;
   p->state = UNUSED;
 }
 
@@ -242,28 +315,52 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
+// Start a kernel thread that runs fn(), which must not return.
+// It has no user memory, and is scheduled like any process.
+void
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+  p->kfunc = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  setrunnable(p);
+  release(&p->lock);
+}
+
 // Grow or shrink user memory by n bytes.
+// Growing only reserves the address space; each page
+// is allocated when first touched (see pagefault()).
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    if(sz + n > TRAPFRAME)
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    if((sz = pagedealloc(p, sz, sz + n)) == p->sz)
+      return -1;
   }
   p->sz = sz;
+  if(n > 0){
+    acquiresleep(&p->pglock);
+    pageswapfile(p);
+    releasesleep(&p->pglock);
+  }
   return 0;
 }
 
@@ -276,8 +373,13 @@ fork(void)
   struct proc *np;
   struct proc *p = myproc();
 
+  // Keep the pageout daemon away from the parent's pages
+  // until the child has a consistent copy of them.
+  acquiresleep(&p->pglock);
+
   // Allocate process.
   if((np = allocproc()) == 0){
+    releasesleep(&p->pglock);
     return -1;
   }
 
@@ -285,10 +387,24 @@ fork(void)
   if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
     freeproc(np);
     release(&np->lock);
+    releasesleep(&p->pglock);
     return -1;
   }
   np->sz = p->sz;
 
+  // Copy the parent's swap file. This sleeps, so it can't be
+  // done holding np->lock; nobody else looks at a USED proc.
+  release(&np->lock);
+  if(pagefork(p, np) < 0){
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    releasesleep(&p->pglock);
+    return -1;
+  }
+  releasesleep(&p->pglock);
+  acquire(&np->lock);
+
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
 
@@ -303,6 +419,8 @@ fork(void)
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  np->nice = np->prio = p->nice;
+
   pid = np->pid;
 
   release(&np->lock);
@@ -312,7 +430,7 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -353,6 +471,18 @@ exit(int status)
     }
   }
 
+  // Forget the resident pages, so that the pageout daemon
+  // leaves them (and the swap file) alone from now on.
+  acquiresleep(&p->pglock);
+  memset(p->ram, 0, sizeof(p->ram));
+  p->nram = 0;
+  p->nmega = 0;
+  if(p->swapFile){
+    removeSwapFile(p);
+    p->swapFile = 0;
+  }
+  releasesleep(&p->pglock);
+
   begin_op();
   iput(p->cwd);
   end_op();
@@ -427,10 +557,178 @@ wait(uint64 addr)
   }
 }
 
+// Make p RUNNABLE and add it to its CPU's run queue.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *q = &runq[p->cpu];
+
+  p->state = RUNNABLE;
+  acquire(&q->lock);
+  enqueue(q, p);
+  release(&q->lock);
+  kick(p->cpu);
+}
+
+// Add p to the tail of its level of q, first moving it to its
+// nice level if it hasn't been since the last boost, or if
+// it is above it. Caller holds q->lock.
+static void
+enqueue(struct runq *q, struct proc *p)
+{
+  uint epoch = ticks / BOOSTTICKS;
+
+  if(p->epoch != epoch || p->prio < p->nice){
+    p->epoch = epoch;
+    p->prio = p->nice;
+    p->used = 0;
+  }
+  p->rqnext = 0;
+  if(q->tail[p->prio])
+    q->tail[p->prio]->rqnext = p;
+  else
+    q->head[p->prio] = p;
+  q->tail[p->prio] = p;
+  q->n++;
+}
+
+// Boost the processes waiting on q, if it hasn't been since
+// the last boost, by queueing them again.
+static void
+boost(struct runq *q)
+{
+  struct proc *p, *next, *all = 0, **tail = &all;
+  int i;
+
+  acquire(&q->lock);
+  if(q->epoch != ticks / BOOSTTICKS){
+    q->epoch = ticks / BOOSTTICKS;
+    for(i = 0; i < NPRIO; i++){
+      *tail = q->head[i];
+      if(q->head[i])
+        tail = &q->tail[i]->rqnext;
+      q->head[i] = q->tail[i] = 0;
+    }
+    q->n = 0;
+    for(p = all; p; p = next){
+      next = p->rqnext;
+      enqueue(q, p);
+    }
+  }
+  release(&q->lock);
+}
+
+// A process has been added to CPU id's run queue: if it is
+// idle, or it is running another process and some other CPU
+// is idle, interrupt the idle CPU so it runs or steals the
+// process, rather than leave it waiting for a clock tick.
+static void
+kick(int id)
+{
+  int i;
+
+  // pairs with the barrier in idle(): either the idle CPU
+  // sees the new process, or we see it idle.
+  __sync_synchronize();
+  if(cpus[id].idle){
+    timerkick(id);
+    return;
+  }
+  // a CPU between processes picks the new one up itself,
+  // unless there are more than it can run.
+  if(cpus[id].proc == 0 && runq[id].n <= 1)
+    return;
+  for(i = 0; i < NCPU; i++){
+    if(cpus[i].idle){
+      timerkick(i);
+      return;
+    }
+  }
+}
+
+// Nothing to run on CPU c: wait for an interrupt, without
+// clock ticks until a sleeping process is due, so that an idle
+// machine stays idle. kick() interrupts c when a process is
+// added to a run queue.
+static void
+idle(struct cpu *c)
+{
+  struct runq *q;
+
+  // with interrupts off, one that arrives after the check
+  // below stays pending, and wfi returns at once. the timer
+  // is set before c is seen to be idle, so that it can't
+  // overwrite the deadline of a kick().
+  intr_off();
+  timeridle();
+  c->idle = 1;
+  __sync_synchronize();
+  for(q = runq; q < &runq[NCPU]; q++){
+    if(q->n > 0)
+      break;
+  }
+  if(q == &runq[NCPU])
+    wfi();
+  c->idle = 0;
+  timerbusy();
+}
+
+// Take the first process off the highest non-empty level of q,
+// or return 0 if q is empty.
+// The process stays RUNNABLE until the caller runs it.
+static struct proc*
+dequeue(struct runq *q)
+{
+  struct proc *p = 0;
+  int i;
+
+  acquire(&q->lock);
+  for(i = 0; i < NPRIO; i++){
+    if((p = q->head[i]) != 0){
+      q->head[i] = p->rqnext;
+      if(q->head[i] == 0)
+        q->tail[i] = 0;
+      q->n--;
+      break;
+    }
+  }
+  release(&q->lock);
+  return p;
+}
+
+// The next process for CPU id to run: the first on its own
+// run queue, or else one stolen from the longest queue.
+// Returns 0 if no process is RUNNABLE.
+static struct proc*
+pickproc(int id)
+{
+  struct proc *p;
+  struct runq *q, *busiest;
+
+  if(runq[id].epoch != ticks / BOOSTTICKS)
+    boost(&runq[id]);
+  if((p = dequeue(&runq[id])) != 0)
+    return p;
+  // the lengths are read without locks; a stale one only
+  // makes for a worse choice, or a later steal.
+  for(;;){
+    busiest = 0;
+    for(q = runq; q < &runq[NCPU]; q++){
+      if(q->n > 0 && (busiest == 0 || q->n > busiest->n))
+        busiest = q;
+    }
+    if(busiest == 0)
+      return 0;
+    if((p = dequeue(busiest)) != 0)
+      return p;
+  }
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - choose a process to run, from its run queue.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -439,28 +737,36 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
-  
+  int id = c - cpus;
+
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+    if((p = pickproc(id)) == 0){
+      // nothing to run: get a page ready for kalloc_zeroed(),
+      // or if there are enough, wait.
+      if(!kzeroidle())
+        idle(c);
+      continue;
     }
+
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler");
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = id;
+    c->proc = p;
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -497,7 +803,38 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
+  sched();
+  release(&p->lock);
+}
+
+// Called on each clock interrupt while p runs. Once p has run
+// for its level's quantum, it drops a level and gives up the
+// CPU; it gives it up sooner if a process at a higher level is
+// waiting for this CPU.
+void
+timeryield(void)
+{
+  struct proc *p = myproc();
+  struct runq *q;
+  int i;
+
+  acquire(&p->lock);
+  if(++p->used >= QUANTUM(p->prio)){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->used = 0;
+  } else {
+    // an unlocked peek; a stale answer only delays the switch.
+    q = &runq[p->cpu];
+    for(i = 0; i < p->prio && q->head[i] == 0; i++)
+      ;
+    if(i == p->prio){
+      release(&p->lock);
+      return;
+    }
+  }
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -523,26 +860,49 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kfunc();
+  panic("kthread returned");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *sq = chanq(chan);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // Once we hold chan's sleep queue lock,
+  // we can be guaranteed that we won't miss
+  // any wakeup (wakeup locks it),
   // so it's okay to release lk.
 
+  acquire(&sq->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
-  // Go to sleep.
+  // Go to sleep, and up a level for not using the CPU.
   p->chan = chan;
   p->state = SLEEPING;
+  if(p->prio > p->nice){
+    p->prio--;
+    p->used = 0;
+  }
+  p->sqnext = sq->head;
+  sq->head = p;
+  release(&sq->lock);
 
   sched();
 
@@ -559,17 +919,40 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  struct sleepq *sq = chanq(chan);
+  struct proc *p, **pp;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
+  acquire(&sq->lock);
+  for(pp = &sq->head; (p = *pp) != 0; ){
+    if(p->chan == chan){
       acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
+      *pp = p->sqnext;
+      setrunnable(p);
       release(&p->lock);
+    } else {
+      pp = &p->sqnext;
     }
   }
+  release(&sq->lock);
+}
+
+// Wake p if it is still sleeping on chan.
+static void
+wakeproc(struct proc *p, void *chan)
+{
+  struct sleepq *sq = chanq(chan);
+  struct proc **pp;
+
+  acquire(&sq->lock);
+  acquire(&p->lock);
+  if(p->state == SLEEPING && p->chan == chan){
+    for(pp = &sq->head; *pp != p; pp = &(*pp)->sqnext)
+      ;
+    *pp = p->sqnext;
+    setrunnable(p);
+  }
+  release(&p->lock);
+  release(&sq->lock);
 }
 
 // Kill the process with the given pid.
@@ -579,14 +962,43 @@ int
 kill(int pid)
 {
   struct proc *p;
+  void *chan;
 
   for(p = proc; p < &proc[NPROC]; p++){
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
+      chan = p->state == SLEEPING ? p->chan : 0;
+      release(&p->lock);
+      // Wake process from sleep(). Its sleep queue must
+      // be locked first, so it is woken after releasing
+      // p->lock, if it is still asleep.
+      if(chan)
+        wakeproc(p, chan);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// Set the nice level of the process with the given pid: the
+// highest priority level it may reach, 0 being the highest.
+// A RUNNABLE process keeps its level until it is next queued.
+int
+setpriority(int pid, int nice)
+{
+  struct proc *p;
+
+  if(nice < 0 || nice >= NPRIO)
+    return -1;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      p->nice = nice;
+      if(p->state != RUNNABLE){
+        p->prio = nice;
+        p->used = 0;
       }
       release(&p->lock);
       return 0;
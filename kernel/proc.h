@@ -24,6 +24,7 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int idle;                   // Waiting in idle() for a process to run?
 };
 
 extern struct cpu cpus[NCPU];
@@ -80,6 +81,15 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A user page tracked by the paging code in paging.c.
+struct page {
+  int used;                    // Is this entry in use?
+  uint64 va;                   // User virtual address of the page
+  uint seq;                    // When the page became resident (FIFO order)
+  uint age;                    // Shifted-in PTE_A history (NFUA, LAPA)
+  int ra;                      // Read ahead, and not yet seen accessed
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -88,10 +98,29 @@ struct proc {
 
   // p->lock must be held when using these:
   enum procstate state;        // Process state
-  void *chan;                  // If non-zero, sleeping on chan
+  void *chan;                  // If non-zero, sleeping on chan (and
+                               //   its sleep queue's lock to set it)
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU whose run queue it joins when RUNNABLE
+  int nice;                    // Highest priority level it may reach
+
+  // p->lock, or its run queue's lock while it is RUNNABLE,
+  // must be held when using these:
+  int prio;                    // Priority level; 0 is the highest
+  int used;                    // Clock ticks used at this level
+  uint epoch;                  // Boost period it was last boosted in
+
+  // its run queue's lock must be held when using this:
+  struct proc *rqnext;         // Next process on the run queue
+
+  // its sleep queue's lock must be held when using this:
+  struct proc *sqnext;         // Next process on the sleep queue
+
+  // tickslock must be held when using these:
+  uint wakeat;                 // Tick to wake at in sleepticks()
+  struct proc *tnext;          // Next process on the timer queue
 
   // proc_tree_lock must be held when using this:
   struct proc *parent;         // Parent process
@@ -105,6 +134,25 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  void (*kfunc)(void);         // Body of a kernel thread, or 0
+  uint64 pinva;                // User pages pinned by pagepin()
+  uint64 pinsz;                //   for the current system call
 
-  struct file *swapFile;
+  // paging state; see paging.c. pglock must be held to use
+  // these, or to change the user page table.
+  struct sleeplock pglock;
+  struct file *swapFile;       // Backing store for paged-out pages
+  struct page ram[MAX_PSYC_PAGES];  // Resident pages that may be evicted
+  uchar swapmap[(MAX_SWAP_PAGES+7)/8]; // Bitmap of used swap file slots
+  int swaphint;                // No free slot below this one
+  int swaphwm;                 // Slots ever used
+  int nram;                    // Number of used ram[] entries
+  int nswap;                   // Number of used swap file slots
+  int nzswap;                  // Number of pages in compressed swap
+  int nzero;                   // Number of pages mapping the zero page
+  int nmega;                   // No more megapages than this
+  uint pageseq;                // Source of page seq numbers
+  int agehand;                 // Next ram[] entry for pagetick() to age
+  int rawin;                   // Pages to read ahead on the next fault
+  uint64 lastfault;            // Page read in by the last fault
 };
@@ -0,0 +1,170 @@
+//
+// Slab allocator for small kernel objects, such as pipes and
+// open files, that would waste most of a page each if they
+// came from kalloc(), and that needn't come from a fixed-size
+// table. A cache hands out objects of one size, carved from
+// pages (slabs) that each start with a struct slab and hold as
+// many objects as fit after it. A slab's free objects are
+// chained through their first word. A slab whose objects are
+// all free again goes back to kalloc().
+//
+// Each CPU keeps a magazine of a few free objects per cache,
+// used with interrupts off instead of a lock, so that most
+// allocations and frees don't touch the cache's lock. An empty
+// magazine is refilled, and a full one emptied, half at a time.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+
+#define NCACHE 8      // most caches
+#define MAGSIZE 8     // most objects in a magazine
+
+struct slab {
+  struct slab *next;          // on the cache's partial list
+  struct kmem_cache *cache;
+  void *free;                 // chain of free objects
+  int inuse;                  // objects allocated
+};
+
+struct magazine {
+  void *obj[MAGSIZE];
+  int n;
+};
+
+struct kmem_cache {
+  struct spinlock lock;       // guards partial and its slabs
+  char *name;
+  uint size;                  // bytes per object
+  struct slab *partial;       // slabs with free objects
+  struct magazine mag[NCPU];
+};
+
+struct kmem_cache caches[NCACHE];
+int ncache;
+
+// Make a cache of objects of size bytes.
+// Only called while booting.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;
+  if(ncache == NCACHE || size == 0 || sizeof(struct slab) + size > PGSIZE)
+    panic("kmem_cache_create");
+  c = &caches[ncache++];
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  return c;
+}
+
+// Allocate a slab for c and put it on c's partial list.
+// Caller holds c->lock.
+static struct slab*
+newslab(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *o;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->free = 0;
+  s->inuse = 0;
+  for(o = (char*)(s + 1); o + c->size <= (char*)s + PGSIZE; o += c->size){
+    *(void**)o = s->free;
+    s->free = o;
+  }
+  s->next = c->partial;
+  c->partial = s;
+  return s;
+}
+
+// Take a free object from c's slabs. Caller holds c->lock.
+static void*
+getobj(struct kmem_cache *c)
+{
+  struct slab *s;
+  void *o;
+
+  if((s = c->partial) == 0 && (s = newslab(c)) == 0)
+    return 0;
+  o = s->free;
+  s->free = *(void**)o;
+  s->inuse++;
+  if(s->free == 0)
+    c->partial = s->next;
+  return o;
+}
+
+// Give object o back to its slab, freeing the slab if it
+// is now unused. Caller holds c->lock.
+static void
+putobj(struct kmem_cache *c, void *o)
+{
+  struct slab *s, **sp;
+
+  s = (struct slab*)PGROUNDDOWN((uint64)o);
+  if(s->free == 0){
+    s->next = c->partial;
+    c->partial = s;
+  }
+  *(void**)o = s->free;
+  s->free = o;
+  if(--s->inuse == 0){
+    for(sp = &c->partial; *sp != s; sp = &(*sp)->next)
+      ;
+    *sp = s->next;
+    kfree((void*)s);
+  }
+}
+
+// Allocate an object from c. Its contents are undefined.
+// Returns 0 if out of memory.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *o;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0){
+    acquire(&c->lock);
+    while(m->n < MAGSIZE/2 && (o = getobj(c)) != 0)
+      m->obj[m->n++] = o;
+    release(&c->lock);
+  }
+  o = 0;
+  if(m->n > 0)
+    o = m->obj[--m->n];
+  pop_off();
+  return o;
+}
+
+// Free object o, which came from kmem_cache_alloc(c).
+void
+kmem_cache_free(struct kmem_cache *c, void *o)
+{
+  struct magazine *m;
+
+  if(((struct slab*)PGROUNDDOWN((uint64)o))->cache != c)
+    panic("kmem_cache_free");
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2)
+      putobj(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = o;
+  pop_off();
+}
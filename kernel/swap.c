@@ -0,0 +1,107 @@
+//
+// Swap area: a run of disk blocks past the end of the file
+// system, reserved by mkfs and described by sb.swapstart and
+// sb.nswap. It is carved into page-sized slots that paging.c
+// uses instead of per-process swap files when the area exists.
+// A slot's page is read or written as one sequential transfer
+// of PGSIZE/BSIZE blocks at a computed block number, with no
+// inode, bmap() or log involved.
+//
+// A slot can be shared, e.g. by a parent and child after
+// fork(), so each one has a reference count. Its data is never
+// changed while it is referenced: paging.c writes a page to a
+// fresh slot and drops its reference when it reads it back.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+#include "fs.h"
+
+#define BPP    (PGSIZE / BSIZE)  // blocks per page
+#define NSLOT  (SWAPSIZE / BPP)
+
+struct {
+  struct spinlock lock;
+  uint dev;
+  uint start;                  // first block of the swap area
+  int nslot;                   // 0 if there is no swap area
+  int hint;                    // no free slot below this one
+  uchar ref[NSLOT > 0 ? NSLOT : 1];
+} swap;
+
+// Called by fsinit() once the superblock has been read.
+void
+swapinit(int dev, struct superblock *sb)
+{
+  initlock(&swap.lock, "swap");
+  swap.dev = dev;
+  swap.start = sb->swapstart;
+  swap.nslot = sb->nswap / BPP;
+  if(swap.nslot > NSLOT)
+    swap.nslot = NSLOT;
+  swap.hint = 0;
+}
+
+// Is there a swap area?
+int
+swaparea(void)
+{
+  return swap.nslot > 0;
+}
+
+// Allocate a slot with one reference.
+// Returns the slot number, or -1 if the area is full.
+int
+swapalloc(void)
+{
+  int i;
+
+  acquire(&swap.lock);
+  for(i = swap.hint; i < swap.nslot; i++){
+    if(swap.ref[i] == 0){
+      swap.ref[i] = 1;
+      swap.hint = i + 1;
+      release(&swap.lock);
+      return i;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// Add a reference to a slot.
+void
+swapdup(int slot)
+{
+  acquire(&swap.lock);
+  if(slot < 0 || slot >= swap.nslot || swap.ref[slot] == 0)
+    panic("swapdup");
+  swap.ref[slot]++;
+  release(&swap.lock);
+}
+
+// Drop a reference to a slot, freeing it with the last one.
+void
+swapfree(int slot)
+{
+  acquire(&swap.lock);
+  if(slot < 0 || slot >= swap.nslot || swap.ref[slot] == 0)
+    panic("swapfree");
+  if(--swap.ref[slot] == 0 && slot < swap.hint)
+    swap.hint = slot;
+  release(&swap.lock);
+}
+
+// Read or write the n pages at physical addresses pa[0..n-1]
+// from or to the n consecutive slots starting at slot.
+void
+swaprw(int slot, char **pa, int n, int write)
+{
+  if(slot < 0 || n < 1 || slot + n > swap.nslot)
+    panic("swaprw");
+  virtio_disk_rwpages(swap.start + slot*BPP, (void**)pa, n, write);
+}
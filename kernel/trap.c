@@ -3,12 +3,18 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 
 struct spinlock tickslock;
 uint ticks;
 
+// Processes in sleepticks(), sorted by the tick they wake at,
+// so that a clock tick wakes only those whose time has come.
+// Guarded by tickslock.
+static struct proc *timers;
+
 extern char trampoline[], uservec[], userret[];
 
 // in kernelvec.S, calls kerneltrap().
@@ -67,6 +73,19 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    // page fault. the page may be paged out, or
+    // shared copy-on-write on a store (scause 15).
+    uint64 scause = r_scause();
+    uint64 va = r_stval();
+
+    intr_on();
+
+    if(pagefault(p, va, scause == 15) < 0){
+      printf("usertrap(): unexpected scause %p pid=%d\n", scause, p->pid);
+      printf("            sepc=%p stval=%p\n", p->trapframe->epc, va);
+      p->killed = 1;
+    }
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -76,9 +95,11 @@ usertrap(void)
   if(p->killed)
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
-    yield();
+  // age p's pages and maybe give up the CPU if this is a timer interrupt.
+  if(which_dev == 2){
+    pagetick(p);
+    timeryield();
+  }
 
   usertrapret();
 }
@@ -149,11 +170,11 @@ kerneltrap()
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
+  // maybe give up the CPU if this is a timer interrupt.
   if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
-    yield();
+    timeryield();
 
-  // the yield() may have caused some traps to occur,
+  // the timeryield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
   w_sepc(sepc);
   w_sstatus(sstatus);
@@ -162,12 +183,89 @@ kerneltrap()
 void
 clockintr()
 {
+  struct proc *p;
+  uint now;
+
+  // every CPU that isn't idle takes clock interrupts, and any
+  // of them may have been idle through ticks it didn't take,
+  // so ticks follows the CLINT's clock rather than counting.
+  now = *(uint64*)CLINT_MTIME / TICKINTERVAL;
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  if((int)(now - ticks) > 0)
+    ticks = now;
+  while((p = timers) != 0 && (int)(ticks - p->wakeat) >= 0){
+    timers = p->tnext;
+    wakeup(&p->wakeat);
+  }
+  pageoutkick();
   release(&tickslock);
 }
 
+// Sleep for n clock ticks.
+// Returns -1 if the process is killed first, 0 otherwise.
+int
+sleepticks(int n)
+{
+  struct proc *p = myproc();
+  struct proc **pp;
+
+  acquire(&tickslock);
+  p->wakeat = ticks + n;
+  if((int)(ticks - p->wakeat) >= 0){
+    release(&tickslock);
+    return 0;
+  }
+  for(pp = &timers; *pp && (int)((*pp)->wakeat - p->wakeat) <= 0; pp = &(*pp)->tnext)
+    ;
+  p->tnext = *pp;
+  *pp = p;
+
+  // clockintr() takes p off the queue once it is due, so it
+  // is still on it only if it was killed.
+  while((int)(ticks - p->wakeat) < 0){
+    if(p->killed){
+      for(pp = &timers; *pp != p; pp = &(*pp)->tnext)
+        ;
+      *pp = p->tnext;
+      release(&tickslock);
+      return -1;
+    }
+    sleep(&p->wakeat, &tickslock);
+  }
+  release(&tickslock);
+  return 0;
+}
+
+// Called by an idle CPU before it waits for an interrupt:
+// take no clock interrupts until the first process in
+// sleepticks() is due, if there is one.
+void
+timeridle(void)
+{
+  uint64 when = -1;
+
+  acquire(&tickslock);
+  if(timers)
+    when = (uint64)timers->wakeat * TICKINTERVAL;
+  release(&tickslock);
+  *(uint64*)CLINT_MTIMECMP(cpuid()) = when;
+}
+
+// Called by a CPU that was idle and has work again:
+// take a clock interrupt every tick once more.
+void
+timerbusy(void)
+{
+  *(uint64*)CLINT_MTIMECMP(cpuid()) = *(uint64*)CLINT_MTIME + TICKINTERVAL;
+}
+
+// Make CPU id take a clock interrupt now, to end its idle wait.
+void
+timerkick(int id)
+{
+  *(uint64*)CLINT_MTIMECMP(id) = *(uint64*)CLINT_MTIME;
+}
+
 // check if it's an external interrupt or software interrupt,
 // and handle it.
 // returns 2 if timer interrupt,
@@ -204,10 +302,8 @@ devintr()
     // software interrupt from a machine-mode timer interrupt,
     // forwarded by timervec in kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
+    clockintr();
+
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
@@ -20,6 +20,10 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
+// most data buffers in one request: the rest of the
+// queue goes to its header and status descriptors.
+#define MAXSEG (NUM - 2)
+
 static struct disk {
   // the virtio driver and device mostly communicate through a set of
   // structures in RAM. pages[] allocates that memory. pages[] is a
@@ -61,7 +65,7 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    int *busy;   // cleared, and woken up, on completion
     char status;
   } info[NUM];
 
@@ -184,12 +188,12 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
+// disk transfers use one per data buffer, plus two.
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -200,27 +204,33 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// transfer n buffers of len bytes each, data[0..n-1], between
+// memory and consecutive disk sectors starting at sector, as one
+// request. each buffer must be physically contiguous, since the
+// device DMAs it. *busy is set while the device owns the data.
+static void
+disk_rw(uint64 sector, void **data, int n, uint len, int write, int *busy)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  if(n < 1 || n > MAXSEG)
+    panic("disk_rw");
 
   acquire(&disk.vdisk_lock);
 
   // the spec's Section 5.2 says that legacy block operations use
   // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // data, one for a 1-byte status result. the data may also be
+  // split across a chain of descriptors, one per buffer.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors.
+  int idx[NUM];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(alloc_descs(idx, n + 2) == 0) {
       break;
     }
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -237,24 +247,26 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 1; i <= n; i++){
+    disk.desc[idx[i]].addr = (uint64) data[i-1];
+    disk.desc[idx[i]].len = len;
+    if(write)
+      disk.desc[idx[i]].flags = 0; // device reads data
+    else
+      disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes data
+    disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i+1];
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // record the busy flag for virtio_disk_intr().
+  *busy = 1;
+  disk.info[idx[0]].busy = busy;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -269,16 +281,38 @@ virtio_disk_rw(struct buf *b, int write)
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
   // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+  while(*busy == 1) {
+    sleep(busy, &disk.vdisk_lock);
   }
 
-  disk.info[idx[0]].b = 0;
+  disk.info[idx[0]].busy = 0;
   free_chain(idx[0]);
 
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  void *data = b->data;
+
+  disk_rw(b->blockno * (BSIZE / 512), &data, 1, BSIZE, write, &b->disk);
+}
+
+// read or write the n pages at physical addresses pa[0..n-1]
+// from or to the n*PGSIZE/BSIZE consecutive blocks starting at
+// blockno, with as few requests as the queue allows.
+void
+virtio_disk_rwpages(uint blockno, void **pa, int n, int write)
+{
+  int busy, m;
+
+  for(; n > 0; n -= m, pa += m, blockno += m * (PGSIZE / BSIZE)){
+    m = n < MAXSEG ? n : MAXSEG;
+    disk_rw(blockno * (BSIZE / 512), pa, m, PGSIZE, write, &busy);
+  }
+}
+
 void
 virtio_disk_intr()
 {
@@ -304,9 +338,9 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    int *busy = disk.info[id].busy;
+    *busy = 0;   // disk is done with the data
+    wakeup(busy);
 
     disk.used_idx += 1;
   }
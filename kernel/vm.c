@@ -3,6 +3,9 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -11,6 +14,12 @@
  */
 pagetable_t kernel_pagetable;
 
+/*
+ * a page of zeros, mapped read-only into user memory
+ * that has been read but never written.
+ */
+char *zeropage;
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
@@ -21,8 +30,7 @@ kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -30,6 +38,9 @@ kvmmake(void)
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT, so that an idle CPU can reprogram its timer
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
@@ -37,6 +48,8 @@ kvmmake(void)
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
+  // all but the megapage that etext falls in, where the
+  // permissions change, is mapped with megapages.
   kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
@@ -54,6 +67,9 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+
+  if((zeropage = kalloc_zeroed()) == 0)
+    panic("kvminit");
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -77,6 +93,10 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A leaf PTE in the level-1 page table maps a 2-megabyte
+// megapage, which has no level-0 PTEs; walk() returns 0
+// for addresses in one, and walkmega() finds its PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
@@ -86,17 +106,38 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte))
+        return 0;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
   return &pagetable[PX(0, va)];
 }
 
+// Return the address of the leaf PTE in the level-1 page
+// table that maps the megapage containing va, or 0 if va
+// is not in a megapage.
+pte_t *
+walkmega(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    panic("walkmega");
+
+  pte = &pagetable[PX(2, va)];
+  if((*pte & PTE_V) == 0 || PTE_LEAF(*pte))
+    return 0;
+  pte = &((pagetable_t)PTE2PA(*pte))[PX(1, va)];
+  if((*pte & PTE_V) == 0 || !PTE_LEAF(*pte))
+    return 0;
+  return pte;
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -104,30 +145,74 @@ uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
-  uint64 pa;
+  uint64 pa, off = 0;
 
   if(va >= MAXVA)
     return 0;
 
   pte = walk(pagetable, va, 0);
+  if(pte == 0 && (pte = walkmega(pagetable, va)) != 0)
+    off = PGROUNDDOWN(va) % MEGAPGSIZE;
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = PTE2PA(*pte) + off;
   return pa;
 }
 
-// add a mapping to the kernel page table.
+// Map the megapage at pa at va, both aligned to MEGAPGSIZE.
+// Returns 0 on success, -1 if the level-1 page table
+// couldn't be allocated.
+static int
+mapmega(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte;
+  pagetable_t pt;
+
+  pte = &pagetable[PX(2, va)];
+  if(*pte & PTE_V){
+    pt = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if((pt = (pagetable_t)kalloc_zeroed()) == 0)
+      return -1;
+    *pte = PA2PTE(pt) | PTE_V;
+  }
+  pte = &pt[PX(1, va)];
+  if(*pte & PTE_V)
+    panic("mapmega: remap");
+  *pte = PA2PTE(pa) | perm | PTE_V;
+  return 0;
+}
+
+// add a mapping to the kernel page table, with megapages
+// wherever va, pa and sz allow, to save TLB entries.
 // only used when booting.
 // does not flush TLB or enable paging.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 n;
+
+  while(sz > 0){
+    if(va % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 && sz >= MEGAPGSIZE){
+      n = MEGAPGSIZE;
+      if(mapmega(kpgtbl, va, pa, perm) != 0)
+        panic("kvmmap");
+    } else {
+      // pages up to the next megapage boundary.
+      n = MEGAPGSIZE - va % MEGAPGSIZE;
+      if(n > sz)
+        n = sz;
+      if(mappages(kpgtbl, va, n, pa, perm) != 0)
+        panic("kvmmap");
+    }
+    va += n;
+    pa += n;
+    sz -= n;
+  }
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -156,8 +241,20 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// Drop a reference to each page of the megapage at pa.
+static void
+megafree(uint64 pa)
+{
+  uint64 a;
+
+  for(a = pa; a < pa + MEGAPGSIZE; a += PGSIZE)
+    kfree((void*)a);
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that are not mapped, as lazily
+// allocated ones may not be, are skipped. A megapage must
+// be removed whole; see uvmsplit().
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
@@ -169,13 +266,23 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+    if((pte = walk(pagetable, a, 0)) == 0){
+      // lazily allocated pages may never have been touched.
+      if((pte = walkmega(pagetable, a)) == 0)
+        continue;
+      if(a % MEGAPGSIZE != 0 || a + MEGAPGSIZE > va + npages*PGSIZE)
+        panic("uvmunmap: part of a megapage");
+      if(do_free)
+        megafree(PTE2PA(*pte));
+      *pte = 0;
+      a += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
+    if((*pte & (PTE_V|PTE_PG)) == 0)
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
-    if(do_free){
+    if(do_free && (*pte & PTE_V)){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
     }
@@ -189,10 +296,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -206,8 +312,7 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -225,12 +330,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -240,6 +344,75 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
   return newsz;
 }
 
+// Replace the 512 PTEs of the aligned extent at va with a
+// megapage, if each maps a writable user page of pagetable's
+// alone (not shared copy-on-write, not the zero page, not
+// paged out), all with the same permissions. The pages are
+// copied into the megapage and freed, as is their page-table
+// page; the caller must flush the TLB.
+// Returns 0 on success, -1 if the extent doesn't qualify
+// or there is no memory for the megapage.
+int
+uvmmerge(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  pagetable_t pt;
+  uint64 perm;
+  char *mem;
+  int i;
+
+  pte = &pagetable[PX(2, va)];
+  if((*pte & PTE_V) == 0 || PTE_LEAF(*pte))
+    return -1;
+  pte = &((pagetable_t)PTE2PA(*pte))[PX(1, va)];
+  if((*pte & PTE_V) == 0 || PTE_LEAF(*pte))
+    return -1;
+  pt = (pagetable_t)PTE2PA(*pte);
+
+  // from the top down, since extents usually fill bottom up.
+  perm = PTE_FLAGS(pt[0]) & ~(PTE_A|PTE_D);
+  if((perm & (PTE_V|PTE_W|PTE_U)) != (PTE_V|PTE_W|PTE_U))
+    return -1;
+  for(i = 511; i >= 0; i--){
+    if((PTE_FLAGS(pt[i]) & ~(PTE_A|PTE_D)) != perm ||
+       krefcount((void*)PTE2PA(pt[i])) != 1)
+      return -1;
+  }
+
+  if((mem = kalloc_order(MEGAPGORDER)) == 0)
+    return -1;
+  for(i = 0; i < 512; i++){
+    memmove(mem + i*PGSIZE, (char*)PTE2PA(pt[i]), PGSIZE);
+    kfree((void*)PTE2PA(pt[i]));
+  }
+  *pte = PA2PTE(mem) | perm;
+  kfree((void*)pt);
+  return 0;
+}
+
+// Split the megapage containing va, if there is one, into
+// ordinary PTEs with the same flags, so that its pages can be
+// unmapped or copied one by one. Each page already has its
+// own reference. The old translation remains valid until the
+// TLB is flushed, since it maps the same memory.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  pagetable_t pt;
+  int i;
+
+  if((pte = walkmega(pagetable, va)) == 0)
+    return 0;
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  for(i = 0; i < 512; i++)
+    pt[i] = *pte + PA2PTE((uint64)i * PGSIZE);
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
+}
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
@@ -259,14 +432,15 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 }
 
 // Recursively free page-table pages.
-// All leaf mappings must already have been removed.
+// All leaf mappings, megapages included, must already
+// have been removed.
 void
 freewalk(pagetable_t pagetable)
 {
   // there are 2^9 = 512 PTEs in a page table.
   for(int i = 0; i < 512; i++){
     pte_t pte = pagetable[i];
-    if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0){
+    if((pte & PTE_V) && !PTE_LEAF(pte)){
       // this PTE points to a lower-level page table.
       uint64 child = PTE2PA(pte);
       freewalk((pagetable_t)child);
@@ -290,32 +464,51 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies the page table, but shares the physical
+// memory: writable pages become read-only and
+// copy-on-write in both, until uvmcow() gives the
+// first to store to one its own copy. old's stale
+// writable TLB entries go when its process next
+// returns to user space, which reloads satp.
+// Paged-out PTEs are copied as they are; see
+// pagefork(). Megapages are shared whole.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
-  uint64 pa, i;
+  pte_t *pte, *npte;
+  uint64 pa, a, i;
   uint flags;
-  char *mem;
 
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+    if((pte = walk(old, i, 0)) == 0 && (pte = walkmega(old, i)) != 0){
+      if(*pte & PTE_W)
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+      pa = PTE2PA(*pte);
+      if(mapmega(new, i, pa, PTE_FLAGS(*pte)) != 0)
+        goto err;
+      for(a = pa; a < pa + MEGAPGSIZE; a += PGSIZE)
+        kdup((void*)a);
+      i += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
+    // skip lazily allocated pages that were never touched.
+    if(pte == 0 || (*pte & (PTE_V|PTE_PG)) == 0)
+      continue;
+    if(*pte & PTE_PG){
+      if((npte = walk(new, i, 1)) == 0)
+        goto err;
+      *npte = *pte;
+      continue;
+    }
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    kdup((void*)pa);
   }
   return 0;
 
@@ -324,6 +517,68 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   return -1;
 }
 
+// Does no one else have a reference to a page of
+// the megapage at pa?
+static int
+megaprivate(uint64 pa)
+{
+  uint64 a;
+
+  for(a = pa; a < pa + MEGAPGSIZE; a += PGSIZE){
+    if(krefcount((void*)a) > 1)
+      return 0;
+  }
+  return 1;
+}
+
+// Make user page va writable for pagetable alone, copying it
+// if it is shared copy-on-write. A shared megapage is split,
+// and only va's page copied. Doesn't sleep. Returns its
+// physical address, or 0 if va is not mapped or not writable,
+// maps the zero page, or no memory is free for the copy.
+uint64
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  char *mem;
+
+  if(va >= MAXVA)
+    return 0;
+  va = PGROUNDDOWN(va);
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 && (pte = walkmega(pagetable, va)) != 0){
+    if((*pte & PTE_U) == 0)
+      return 0;
+    if((*pte & PTE_COW) && megaprivate(PTE2PA(*pte)))
+      *pte = (*pte & ~PTE_COW) | PTE_W;
+    if(*pte & PTE_W)
+      return PTE2PA(*pte) + va % MEGAPGSIZE;
+    if(uvmsplit(pagetable, va) < 0)
+      return 0;
+    pte = walk(pagetable, va, 0);
+  }
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0)
+    return 0;
+  pa = PTE2PA(*pte);
+  if(*pte & PTE_W)
+    return pa;
+  // the zero page is replaced by pagefault(), which
+  // tracks the new page for paging.
+  if((*pte & PTE_COW) == 0 || pa == (uint64)zeropage)
+    return 0;
+
+  if(krefcount((void*)pa) > 1){
+    if((mem = kalloc()) == 0)
+      return 0;
+    memmove(mem, (char*)pa, PGSIZE);
+    kfree((void*)pa);
+    pa = (uint64)mem;
+  }
+  *pte = PA2PTE(pa) | ((PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W);
+  return pa;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -337,6 +592,33 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Look up user page va0 for copyin(), or for copyout() if
+// write, in which case a copy-on-write page is copied first.
+// Pages of the current process are brought back in if they
+// are paged out. Returns the physical address with interrupts
+// off, so that the pageout daemon can't evict the page while
+// the caller copies; the caller then calls pop_off(). Returns
+// 0, leaving interrupts alone, if va0 is not mapped.
+static uint64
+copyaddr(pagetable_t pagetable, uint64 va0, int write)
+{
+  struct proc *p = myproc();
+  uint64 pa0;
+
+  for(;;){
+    push_off();
+    if(write)
+      pa0 = uvmcow(pagetable, va0);
+    else
+      pa0 = walkaddr(pagetable, va0);
+    if(pa0 != 0)
+      return pa0;
+    pop_off();
+    if(p == 0 || p->pagetable != pagetable || pagefault(p, va0, write) < 0)
+      return 0;
+  }
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -347,13 +629,14 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = copyaddr(pagetable, va0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
     memmove((void *)(pa0 + (dstva - va0)), src, n);
+    pop_off();
 
     len -= n;
     src += n;
@@ -372,13 +655,14 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = copyaddr(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
     memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    pop_off();
 
     len -= n;
     dst += n;
@@ -399,7 +683,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = copyaddr(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -420,6 +704,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
+    pop_off();
 
     srcva = va0 + PGSIZE;
   }
@@ -0,0 +1,299 @@
+//
+// Compressed swap: evicted pages kept in RAM, compressed, so
+// that paging them back in needs no disk I/O. paging.c offers
+// each page it evicts here first, and only writes it to a swap
+// slot on disk if it doesn't compress well enough, or if the
+// pool already holds ZSWAPPAGES pages of compressed data.
+//
+// A page whose words are all the same (most often zero) is
+// kept as just that word. Any other page is compressed with a
+// small LZ77 coder and stored in the pool, which is made of
+// pages from kalloc() cut into CHUNK-byte chunks; a compressed
+// page takes a run of chunks within one pool page. Pool pages
+// are allocated as needed and freed once empty.
+//
+// Like swap slots, entries are reference counted so that
+// fork() can share them, and are never changed while in use.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+
+#define NZENT 1024                 // most compressed pages
+#define CHUNK 64                   // pool allocation unit
+#define NCHUNK (PGSIZE / CHUNK)    // chunks per pool page
+#define MAXLEN (PGSIZE * 3 / 4)    // don't keep pages that compress worse
+#define HASHBITS 10
+
+#define Z_FILL 1                   // all words equal to fill
+#define Z_LZ   2                   // len bytes of LZ data in the pool
+
+struct zent {
+  uchar ref;
+  uchar kind;
+  ushort len;                      // compressed length (Z_LZ)
+  ushort pg;                       // pool page (Z_LZ)
+  ushort chunk;                    // first chunk in it (Z_LZ)
+  uint64 fill;                     // the repeated word (Z_FILL)
+};
+
+struct {
+  struct spinlock lock;
+  struct zent ent[NZENT];
+  int hint;                        // no free entry below this one
+  char *pool[ZSWAPPAGES > 0 ? ZSWAPPAGES : 1];
+  uint64 map[ZSWAPPAGES > 0 ? ZSWAPPAGES : 1]; // used chunks
+  char buf[MAXLEN];                // compressor output
+  ushort hash[1 << HASHBITS];      // compressor match table
+} zswap;
+
+void
+zswapinit(void)
+{
+  initlock(&zswap.lock, "zswap");
+}
+
+// If every word of the page at pa is the same,
+// set *fill to it and return 1.
+static int
+samefilled(uint64 *pa, uint64 *fill)
+{
+  int i;
+
+  for(i = 1; i < PGSIZE / sizeof(uint64); i++){
+    if(pa[i] != pa[0])
+      return 0;
+  }
+  *fill = pa[0];
+  return 1;
+}
+
+// The compressed format is a sequence of runs, each starting
+// with a control byte c. If c < 0x80, c+1 literal bytes follow.
+// Otherwise the next two bytes are a little-endian offset d,
+// and (c & 0x7f)+3 bytes are copied from d bytes back.
+
+#define MINMATCH 3
+#define MAXMATCH (0x7f + MINMATCH)
+#define MAXLIT 0x80
+
+static uint
+hash3(uchar *s)
+{
+  uint x = s[0] | (s[1] << 8) | (s[2] << 16);
+
+  return (x * 2654435761U) >> (32 - HASHBITS);
+}
+
+// Compress the page at src into zswap.buf, greedily taking the
+// match offered by a hash of the next three bytes.
+// Returns the compressed length, or -1 if it is over MAXLEN.
+static int
+lzcompress(uchar *src)
+{
+  uchar *dst = (uchar*)zswap.buf;
+  int i = 0, j = 0, h, n, lit = 0, o = 0;
+
+  memset(zswap.hash, 0xff, sizeof(zswap.hash));
+  while(i < PGSIZE){
+    n = 0;
+    if(i + MINMATCH <= PGSIZE){
+      h = hash3(src + i);
+      j = zswap.hash[h];
+      zswap.hash[h] = i;
+      if(j != 0xffff)
+        while(n < MAXMATCH && i + n < PGSIZE && src[j + n] == src[i + n])
+          n++;
+    }
+    if(n < MINMATCH){
+      // add src[i] to the pending literals, flushing
+      // them once the run is full or the page ends.
+      i++;
+      if(++lit < MAXLIT && i < PGSIZE)
+        continue;
+    }
+    if(lit > 0){
+      if(o + 1 + lit > MAXLEN)
+        return -1;
+      dst[o++] = lit - 1;
+      memmove(dst + o, src + i - lit, lit);
+      o += lit;
+      lit = 0;
+    }
+    if(n >= MINMATCH){
+      if(o + 3 > MAXLEN)
+        return -1;
+      dst[o++] = 0x80 | (n - MINMATCH);
+      dst[o++] = (i - j) & 0xff;
+      dst[o++] = (i - j) >> 8;
+      i += n;
+    }
+  }
+  return o;
+}
+
+// Decompress len bytes at src into the page at dst.
+static void
+lzdecompress(uchar *src, int len, uchar *dst)
+{
+  int i = 0, o = 0, n, d, c;
+
+  while(i < len){
+    c = src[i++];
+    if(c < 0x80){
+      n = c + 1;
+      if(o + n > PGSIZE || i + n > len)
+        panic("lzdecompress");
+      memmove(dst + o, src + i, n);
+      i += n;
+    } else {
+      n = (c & 0x7f) + MINMATCH;
+      d = src[i] | (src[i+1] << 8);
+      i += 2;
+      if(d == 0 || d > o || o + n > PGSIZE)
+        panic("lzdecompress");
+      // byte by byte: the source may overlap what is copied.
+      for(c = 0; c < n; c++)
+        dst[o + c] = dst[o + c - d];
+    }
+    o += n;
+  }
+  if(o != PGSIZE)
+    panic("lzdecompress");
+}
+
+// Allocate n consecutive chunks in some pool page, adding a
+// page to the pool if none has room and the budget allows.
+// Returns 0 and sets *pg and *chunk, or -1.
+static int
+chunkalloc(int n, ushort *pg, ushort *chunk)
+{
+  uint64 m = (1UL << n) - 1;
+  int i, c;
+
+  for(i = 0; i < ZSWAPPAGES; i++){
+    if(zswap.pool[i] == 0)
+      continue;
+    for(c = 0; c + n <= NCHUNK; c++){
+      if((zswap.map[i] & (m << c)) == 0){
+        zswap.map[i] |= m << c;
+        *pg = i;
+        *chunk = c;
+        return 0;
+      }
+    }
+  }
+  for(i = 0; i < ZSWAPPAGES; i++){
+    if(zswap.pool[i] == 0){
+      if((zswap.pool[i] = kalloc()) == 0)
+        return -1;
+      zswap.map[i] = m;
+      *pg = i;
+      *chunk = 0;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static void
+chunkfree(int pg, int chunk, int n)
+{
+  zswap.map[pg] &= ~(((1UL << n) - 1) << chunk);
+  if(zswap.map[pg] == 0){
+    kfree(zswap.pool[pg]);
+    zswap.pool[pg] = 0;
+  }
+}
+
+// Keep a copy of the page at pa, with one reference.
+// Returns its entry number, or -1 if it isn't worth keeping
+// or there is no room.
+int
+zswapstore(char *pa)
+{
+  struct zent *z;
+  int i, len;
+
+  acquire(&zswap.lock);
+  for(i = zswap.hint; i < NZENT; i++){
+    if(zswap.ent[i].ref == 0)
+      break;
+  }
+  if(i == NZENT){
+    release(&zswap.lock);
+    return -1;
+  }
+  z = &zswap.ent[i];
+
+  if(samefilled((uint64*)pa, &z->fill)){
+    z->kind = Z_FILL;
+  } else {
+    if((len = lzcompress((uchar*)pa)) < 0 ||
+       chunkalloc((len + CHUNK - 1) / CHUNK, &z->pg, &z->chunk) < 0){
+      release(&zswap.lock);
+      return -1;
+    }
+    memmove(zswap.pool[z->pg] + z->chunk*CHUNK, zswap.buf, len);
+    z->kind = Z_LZ;
+    z->len = len;
+  }
+  z->ref = 1;
+  zswap.hint = i + 1;
+  release(&zswap.lock);
+  return i;
+}
+
+// Copy entry i's page back out to the page at pa.
+void
+zswapload(int i, char *pa)
+{
+  struct zent *z;
+  uint64 *w;
+
+  acquire(&zswap.lock);
+  if(i < 0 || i >= NZENT || zswap.ent[i].ref == 0)
+    panic("zswapload");
+  z = &zswap.ent[i];
+  if(z->kind == Z_FILL){
+    for(w = (uint64*)pa; w < (uint64*)(pa + PGSIZE); w++)
+      *w = z->fill;
+  } else {
+    lzdecompress((uchar*)zswap.pool[z->pg] + z->chunk*CHUNK, z->len, (uchar*)pa);
+  }
+  release(&zswap.lock);
+}
+
+// Add a reference to entry i.
+void
+zswapdup(int i)
+{
+  acquire(&zswap.lock);
+  if(i < 0 || i >= NZENT || zswap.ent[i].ref == 0)
+    panic("zswapdup");
+  zswap.ent[i].ref++;
+  release(&zswap.lock);
+}
+
+// Drop a reference to entry i, freeing it with the last one.
+void
+zswapfree(int i)
+{
+  struct zent *z;
+
+  acquire(&zswap.lock);
+  if(i < 0 || i >= NZENT || zswap.ent[i].ref == 0)
+    panic("zswapfree");
+  z = &zswap.ent[i];
+  if(--z->ref == 0){
+    if(z->kind == Z_LZ)
+      chunkfree(z->pg, z->chunk, (z->len + CHUNK - 1) / CHUNK);
+    if(i < zswap.hint)
+      zswap.hint = i;
+  }
+  release(&zswap.lock);
+}
@@ -0,0 +1,58 @@
+// Time the kernel's page allocation paths: growing and
+// shrinking the heap, and fork() and exit(). Compare a kernel
+// built with KMEM_DEBUG=1 against one without to see what the
+// junk fills cost.
+
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define ROUNDS 2000
+// few enough pages to stay resident.
+#define NPAGES (MAX_PSYC_PAGES / 2)
+
+int
+heap(void)
+{
+  char *p;
+  int i, j, start;
+
+  start = uptime();
+  for (i = 0; i < ROUNDS; i++) {
+    if ((p = sbrk(NPAGES * PGSIZE)) == (char*)0xffffffffffffffffL) {
+      printf("membench: sbrk failed\n");
+      exit(1);
+    }
+    for (j = 0; j < NPAGES; j++)
+      p[j * PGSIZE] = 1;
+    sbrk(-NPAGES * PGSIZE);
+  }
+  return uptime() - start;
+}
+
+int
+forks(void)
+{
+  int i, pid, start;
+
+  start = uptime();
+  for (i = 0; i < ROUNDS; i++) {
+    if ((pid = fork()) < 0) {
+      printf("membench: fork failed\n");
+      exit(1);
+    }
+    if (pid == 0)
+      exit(0);
+    wait(0);
+  }
+  return uptime() - start;
+}
+
+int
+main(int argc, char *argv[])
+{
+  printf("heap: %d rounds of %d pages in %d ticks\n", ROUNDS, NPAGES, heap());
+  printf("fork: %d forks in %d ticks\n", ROUNDS, forks());
+  exit(0);
+}
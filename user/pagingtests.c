@@ -0,0 +1,734 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+#include "kernel/syscall.h"
+#include "kernel/memlayout.h"
+#include "kernel/riscv.h"
+
+// Pages go to the swap area reserved by mkfs unless the kernel
+// and fs.img were built with make SWAPSIZE=0, when they go to
+// per-process swap files instead; run these tests both ways.
+
+// more pages than a process may keep resident, but fewer
+// than fit in its swap file.
+#define NPAGES (MAX_PSYC_PAGES + MAX_SWAP_PAGES / 2)
+
+// more than half of physical memory.
+#define BIG (80 * 1024 * 1024)
+
+// fill NPAGES fresh pages with a pattern; return the first.
+char *
+fill(void)
+{
+  char *base;
+  int i;
+
+  base = sbrk(NPAGES * PGSIZE);
+  if (base == (char*)0xffffffffffffffffL) {
+    printf("sbrk() failed\n");
+    exit(1);
+  }
+  for (i = 0; i < NPAGES; i++)
+    *(int *)(base + i * PGSIZE) = i;
+  return base;
+}
+
+void
+check(char *base)
+{
+  int i;
+
+  for (i = 0; i < NPAGES; i++) {
+    if (*(int *)(base + i * PGSIZE) != i) {
+      printf("page %d: wrong value %d\n", i, *(int *)(base + i * PGSIZE));
+      exit(1);
+    }
+  }
+}
+
+void
+swap_basic(char *s)
+{
+  char *base = fill();
+
+  // sweep twice so every page is paged out and in again.
+  check(base);
+  check(base);
+  exit(0);
+}
+
+void
+swap_sweep(char *s)
+{
+  char *base = fill();
+  int i;
+
+  // rewrite every page going up, so that pages read ahead
+  // get dirtied, then check them going down.
+  for (i = 0; i < NPAGES; i++)
+    *(int *)(base + i * PGSIZE) = -i;
+  for (i = NPAGES - 1; i >= 0; i--) {
+    if (*(int *)(base + i * PGSIZE) != -i) {
+      printf("page %d: wrong value %d\n", i, *(int *)(base + i * PGSIZE));
+      exit(1);
+    }
+    *(int *)(base + i * PGSIZE) = i;
+  }
+  check(base);
+  exit(0);
+}
+
+// fill page i with words that don't compress, so that it
+// has to go to disk.
+void
+noise(char *page, int i, int check)
+{
+  uint x = i + 1;
+  uint *w;
+
+  for (w = (uint *)page; w < (uint *)(page + PGSIZE); w++) {
+    x = x * 1103515245 + 12345;
+    if (!check)
+      *w = x;
+    else if (*w != x) {
+      printf("page %d: wrong value %x\n", i, *w);
+      exit(1);
+    }
+  }
+}
+
+void
+swap_noise(char *s)
+{
+  char *base = fill();
+  int i;
+
+  // compressed swap would hold fill()'s mostly-zero pages.
+  for (i = 0; i < NPAGES; i++)
+    noise(base + i * PGSIZE, i, 0);
+  for (i = 0; i < NPAGES; i++)
+    noise(base + i * PGSIZE, i, 1);
+  for (i = NPAGES - 1; i >= 0; i--)
+    noise(base + i * PGSIZE, i, 1);
+  exit(0);
+}
+
+void
+swap_syscall(char *s)
+{
+  char *base = fill();
+  int fds[2], i;
+
+  // the first page has been paged out by now; the kernel
+  // must bring it back to copy from it and into it.
+  if (pipe(fds) < 0) {
+    printf("pipe() failed\n");
+    exit(1);
+  }
+  if (write(fds[1], base, sizeof(int)) != sizeof(int)) {
+    printf("write() from paged-out memory failed\n");
+    exit(1);
+  }
+  *(int *)base = -1;
+  for (i = 1; i < NPAGES; i++)
+    *(int *)(base + i * PGSIZE) = i;
+  if (read(fds[0], base, sizeof(int)) != sizeof(int)) {
+    printf("read() into paged-out memory failed\n");
+    exit(1);
+  }
+  check(base);
+  exit(0);
+}
+
+void
+swap_pipe(char *s)
+{
+  char *base = fill(), *buf;
+  int fds[2], pid, n, m, xstatus;
+
+  // more than pagepin() pins, both ways, so that the pipe
+  // code must page the buffers in as it copies.
+  if (pipe(fds) < 0) {
+    printf("pipe() failed\n");
+    exit(1);
+  }
+  if ((pid = fork()) < 0) {
+    printf("fork() failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(fds[1]);
+    buf = sbrk(NPAGES * PGSIZE);
+    for (n = 0; n < NPAGES * PGSIZE; n += m) {
+      if ((m = read(fds[0], buf + n, NPAGES * PGSIZE - n)) <= 0) {
+        printf("read() returned %d after %d bytes\n", m, n);
+        exit(1);
+      }
+    }
+    check(buf);
+    exit(0);
+  }
+  close(fds[0]);
+  if ((n = write(fds[1], base, NPAGES * PGSIZE)) != NPAGES * PGSIZE) {
+    printf("write() returned %d\n", n);
+    exit(1);
+  }
+  close(fds[1]);
+  wait(&xstatus);
+  exit(xstatus);
+}
+
+// a child writes files, through the log, while the parent
+// pages around it, to its swap file with SWAPSIZE=0; neither
+// may see the other's blocks.
+void
+swap_fs(char *s)
+{
+  char *base = fill(), buf[BSIZE];
+  int pid, xstatus, fd, i, j, k;
+
+  if ((pid = fork()) < 0) {
+    printf("fork() failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    for (j = 0; j < 20; j++) {
+      if ((fd = open("swapfs", O_CREATE | O_RDWR)) < 0) {
+        printf("open() failed\n");
+        exit(1);
+      }
+      for (i = 0; i < MAXOPBLOCKS; i++) {
+        memset(buf, j + i, sizeof(buf));
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+          printf("write() failed\n");
+          exit(1);
+        }
+      }
+      close(fd);
+      if ((fd = open("swapfs", O_RDONLY)) < 0) {
+        printf("open() failed\n");
+        exit(1);
+      }
+      for (i = 0; i < MAXOPBLOCKS; i++) {
+        if (read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+          printf("read() failed\n");
+          exit(1);
+        }
+        for (k = 0; k < sizeof(buf); k++) {
+          if (buf[k] != (char)(j + i)) {
+            printf("block %d: wrong value %d\n", i, buf[k]);
+            exit(1);
+          }
+        }
+      }
+      close(fd);
+      unlink("swapfs");
+    }
+    exit(0);
+  }
+  for (j = 0; j < 10; j++) {
+    for (i = 0; i < NPAGES; i++)
+      noise(base + i * PGSIZE, j * NPAGES + i, 0);
+    for (i = NPAGES - 1; i >= 0; i--)
+      noise(base + i * PGSIZE, j * NPAGES + i, 1);
+  }
+  wait(&xstatus);
+  exit(xstatus);
+}
+
+#define NAREA 8
+
+// many processes take slots in the swap area at once, and
+// none may write outside it, over the file system.
+void
+swap_area(char *s)
+{
+  char *base = fill(), buf[BSIZE];
+  int fd, xstatus, i, j, fail = 0;
+
+  if ((fd = open("swaparea", O_CREATE | O_RDWR)) < 0) {
+    printf("open() failed\n");
+    exit(1);
+  }
+  for (i = 0; i < MAXOPBLOCKS; i++) {
+    memset(buf, 'a' + i, sizeof(buf));
+    if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+      printf("write() failed\n");
+      exit(1);
+    }
+  }
+  close(fd);
+
+  for (i = 0; i < NAREA; i++) {
+    if ((j = fork()) < 0) {
+      printf("fork() failed\n");
+      exit(1);
+    }
+    if (j == 0) {
+      for (j = 0; j < NPAGES; j++)
+        noise(base + j * PGSIZE, i * NPAGES + j, 0);
+      for (j = 0; j < NPAGES; j++)
+        noise(base + j * PGSIZE, i * NPAGES + j, 1);
+      exit(0);
+    }
+  }
+  for (i = 0; i < NAREA; i++) {
+    wait(&xstatus);
+    if (xstatus != 0)
+      fail = 1;
+  }
+
+  if ((fd = open("swaparea", O_RDONLY)) < 0) {
+    printf("open() failed\n");
+    exit(1);
+  }
+  for (i = 0; i < MAXOPBLOCKS; i++) {
+    if (read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+      printf("read() failed\n");
+      exit(1);
+    }
+    for (j = 0; j < sizeof(buf); j++) {
+      if (buf[j] != 'a' + i) {
+        printf("block %d: overwritten\n", i);
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+  unlink("swaparea");
+  check(base);
+  exit(fail);
+}
+
+void
+swap_fork(char *s)
+{
+  char *base = fill();
+  int pid, xstatus;
+
+  if ((pid = fork()) < 0) {
+    printf("fork() failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    check(base);
+    exit(0);
+  }
+  wait(&xstatus);
+  if (xstatus != 0)
+    exit(xstatus);
+  check(base);
+  exit(0);
+}
+
+// a page written between every access to the others must
+// come through intact, whichever page the policy evicts.
+void
+swap_hot(char *s)
+{
+  char *base = fill();
+  int *hot = (int *)(base + PGSIZE / 2);
+  int i, j;
+
+  *hot = 0;
+  for (j = 0; j < 4; j++) {
+    for (i = 1; i < NPAGES; i++) {
+      (*hot)++;
+      if (*(int *)(base + i * PGSIZE) != i) {
+        printf("page %d: wrong value %d\n", i, *(int *)(base + i * PGSIZE));
+        exit(1);
+      }
+    }
+  }
+  if (*hot != 4 * (NPAGES - 1)) {
+    printf("hot page: wrong value %d\n", *hot);
+    exit(1);
+  }
+  check(base);
+  exit(0);
+}
+
+// keep paging across clock ticks, so that pagetick() ages
+// and clears the accessed bits of pages in active use.
+void
+swap_aging(char *s)
+{
+  char *base = fill();
+  int i, n, t0;
+
+  t0 = uptime();
+  for (n = 0; uptime() - t0 < 10; n++) {
+    for (i = 0; i < 4; i++)
+      *(int *)(base + i * PGSIZE + sizeof(int)) = n;
+    i = 4 + n % (NPAGES - 4);
+    if (*(int *)(base + i * PGSIZE) != i) {
+      printf("page %d: wrong value %d\n", i, *(int *)(base + i * PGSIZE));
+      exit(1);
+    }
+  }
+  for (i = 0; i < 4; i++) {
+    if (*(int *)(base + i * PGSIZE + sizeof(int)) != n - 1) {
+      printf("page %d: lost a write\n", i);
+      exit(1);
+    }
+  }
+  check(base);
+  exit(0);
+}
+
+#define NFORK 4
+
+void
+swap_forks(char *s)
+{
+  char *base = fill();
+  int pids[NFORK], xstatus, i, j, fail = 0;
+
+  // several processes page at once, each choosing its own
+  // victims among pages they first share.
+  for (i = 0; i < NFORK; i++) {
+    if ((pids[i] = fork()) < 0) {
+      printf("fork() failed\n");
+      exit(1);
+    }
+    if (pids[i] == 0) {
+      check(base);
+      for (j = 0; j < NPAGES; j++)
+        noise(base + j * PGSIZE, (i + 1) * NPAGES + j, 0);
+      for (j = NPAGES - 1; j >= 0; j--)
+        noise(base + j * PGSIZE, (i + 1) * NPAGES + j, 1);
+      exit(0);
+    }
+  }
+  check(base);
+  for (i = 0; i < NFORK; i++) {
+    wait(&xstatus);
+    if (xstatus != 0)
+      fail = 1;
+  }
+  check(base);
+  exit(fail);
+}
+
+void
+swap_fork_private(char *s)
+{
+  char *base = fill();
+  int pid, xstatus, i;
+
+  // the child's swap file is a copy, not the parent's.
+  if ((pid = fork()) < 0) {
+    printf("fork() failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    for (i = 0; i < NPAGES; i++)
+      *(int *)(base + i * PGSIZE) = -i;
+    exit(0);
+  }
+  wait(&xstatus);
+  check(base);
+  exit(xstatus);
+}
+
+void
+lazy_sbrk(char *s)
+{
+  char *base = sbrk(0), *p;
+  int pid, xstatus;
+
+  // reserve far more than physical memory, and touch a
+  // little of it, before and after a fork.
+  if (sbrk(1024 * 1024 * 1024) != base) {
+    printf("sbrk() failed\n");
+    exit(1);
+  }
+  for (p = base; p < base + 1024 * 1024 * 1024; p += 1024 * 1024)
+    *(char **)p = p;
+  if ((pid = fork()) < 0) {
+    printf("fork() failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    for (p = base + PGSIZE; p < base + 1024 * 1024 * 1024; p += 1024 * 1024) {
+      if (*(int *)p != 0)
+        exit(1);
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  for (p = base; p < base + 1024 * 1024 * 1024; p += 1024 * 1024) {
+    if (*(char **)p != p) {
+      printf("wrong value at %p\n", p);
+      exit(1);
+    }
+  }
+  exit(xstatus);
+}
+
+void
+zero_page(char *s)
+{
+  char *base, *p;
+  int sum = 0;
+
+  // read more untouched memory than there is physical memory;
+  // it should all be the one zero page.
+  base = sbrk(2 * BIG);
+  if (base == (char*)0xffffffffffffffffL) {
+    printf("sbrk() failed\n");
+    exit(1);
+  }
+  for (p = base; p < base + 2 * BIG; p += PGSIZE)
+    sum += *p;
+  if (sum != 0) {
+    printf("untouched memory not zero\n");
+    exit(1);
+  }
+
+  // writing one page must not change the others.
+  base[PGSIZE] = 1;
+  if (base[0] != 0 || base[PGSIZE] != 1 || base[2 * PGSIZE] != 0) {
+    printf("write to zero page leaked\n");
+    exit(1);
+  }
+  exit(0);
+}
+
+void
+megapages(char *s)
+{
+  char *base, *mid, *p;
+  int pid, xstatus;
+
+  // fully written 2-megabyte extents of a large heap become
+  // megapages if they stay resident, which fork() shares and
+  // a write in the child splits.
+  base = sbrk(4 * MEGAPGSIZE);
+  if (base == (char*)0xffffffffffffffffL) {
+    printf("sbrk() failed\n");
+    exit(1);
+  }
+  for (p = base; p < base + 4 * MEGAPGSIZE; p += PGSIZE)
+    *(char **)p = p;
+  if ((pid = fork()) < 0) {
+    printf("fork() failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    for (p = base; p < base + 4 * MEGAPGSIZE; p += 2 * PGSIZE)
+      *(char **)p = 0;
+    exit(0);
+  }
+  wait(&xstatus);
+  if (xstatus != 0)
+    exit(xstatus);
+
+  // shrink to the middle of a megapage, then grow again.
+  mid = (char *)MEGAPGROUNDUP((uint64)base) + MEGAPGSIZE / 2;
+  if (sbrk(mid - (char *)sbrk(0)) == (char*)0xffffffffffffffffL) {
+    printf("sbrk() failed to shrink\n");
+    exit(1);
+  }
+  sbrk(MEGAPGSIZE);
+  for (p = base; p < mid; p += PGSIZE) {
+    if (*(char **)p != p) {
+      printf("wrong value at %p\n", p);
+      exit(1);
+    }
+  }
+  if (*(char **)mid != 0) {
+    printf("memory given back not zeroed\n");
+    exit(1);
+  }
+  exit(0);
+}
+
+void
+swap_shrink(char *s)
+{
+  char *base = fill();
+
+  // give back pages that are partly paged out, then grow again.
+  sbrk(-NPAGES * PGSIZE);
+  if (sbrk(0) != base) {
+    printf("sbrk() did not shrink\n");
+    exit(1);
+  }
+  base = fill();
+  check(base);
+  exit(0);
+}
+
+// every page that fits in RAM and the swap file.
+#define MAXPAGES (MAX_PSYC_PAGES + MAX_SWAP_PAGES)
+
+void
+swap_slots(char *s)
+{
+  char *base = fill();
+  int i, j, n;
+
+  // touching pages in a scattered order frees slots here and
+  // there; growing then has to fill those holes first, and
+  // shrinking frees slots for the next round to reuse. they
+  // are swap file slots with SWAPSIZE=0, else swap area ones.
+  for (j = 0; j < 10; j++) {
+    if (sbrk((MAXPAGES - NPAGES) * PGSIZE) == (char*)0xffffffffffffffffL) {
+      printf("sbrk() failed\n");
+      exit(1);
+    }
+    for (i = NPAGES; i < MAXPAGES; i++)
+      noise(base + i * PGSIZE, i, 0);
+    for (n = 0, i = j; n < MAXPAGES; n++, i = (i + 5) % MAXPAGES) {
+      if (i >= NPAGES)
+        noise(base + i * PGSIZE, i, 1);
+      else if (*(int *)(base + i * PGSIZE) != i) {
+        printf("page %d: wrong value %d\n", i, *(int *)(base + i * PGSIZE));
+        exit(1);
+      }
+    }
+    sbrk(-(MAXPAGES - NPAGES) * PGSIZE);
+  }
+  check(base);
+  exit(0);
+}
+
+void
+swap_pressure(char *s)
+{
+  char *base = fill();
+  char *p;
+  int pid;
+
+  // a child takes all free memory, so that the pageout
+  // daemon evicts our pages while we wait. sbrk() doesn't
+  // allocate, so the child touches pages until it is killed
+  // for want of memory.
+  if ((pid = fork()) < 0) {
+    printf("fork() failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    while ((p = sbrk(PGSIZE)) != (char*)0xffffffffffffffffL)
+      *p = 1;
+    exit(0);
+  }
+  wait(0);
+  check(base);
+  exit(0);
+}
+
+void
+cow_fork(char *s)
+{
+  char *base, *top, *p;
+  int pid, xstatus;
+
+  // take more than half of memory, so that fork() can only
+  // succeed by sharing it.
+  base = sbrk(BIG);
+  if (base == (char*)0xffffffffffffffffL) {
+    printf("sbrk() failed\n");
+    exit(1);
+  }
+  for (p = base; p < base + BIG; p += PGSIZE)
+    *p = 0;
+  top = base + BIG - PGSIZE;
+  *(int *)base = 1;
+  *(int *)top = 2;
+
+  if ((pid = fork()) < 0) {
+    printf("fork() failed\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    *(int *)base = 3;
+    *(int *)top = 4;
+    exit(*(int *)base != 3 || *(int *)top != 4);
+  }
+  wait(&xstatus);
+  if (*(int *)base != 1 || *(int *)top != 2) {
+    printf("child's writes seen by parent\n");
+    exit(1);
+  }
+  exit(xstatus);
+}
+
+// run each test in its own process. run returns 1 if child's exit()
+// indicates success.
+int
+run(void f(char *), char *s) {
+  int pid;
+  int xstatus;
+
+  printf("running test %s\n", s);
+  if((pid = fork()) < 0) {
+    printf("runtest: fork error\n");
+    exit(1);
+  }
+  if(pid == 0) {
+    f(s);
+    exit(0);
+  } else {
+    wait(&xstatus);
+    if(xstatus != 0)
+      printf("test %s: FAILED\n", s);
+    else
+      printf("test %s: OK\n", s);
+    return xstatus == 0;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *n = 0;
+  if(argc > 1) {
+    n = argv[1];
+  }
+
+  struct test {
+    void (*f)(char *);
+    char *s;
+  } tests[] = {
+    { swap_basic, "swap basic"},
+    { swap_sweep, "swap sweep"},
+    { swap_noise, "swap noise"},
+    { swap_syscall, "swap syscall"},
+    { swap_pipe, "swap pipe"},
+    { swap_fs, "swap fs"},
+    { swap_area, "swap area"},
+    { swap_fork, "swap fork"},
+    { swap_fork_private, "swap fork private"},
+    { swap_hot, "swap hot"},
+    { swap_forks, "swap forks"},
+    { swap_aging, "swap aging"},
+    { swap_shrink, "swap shrink"},
+    { swap_slots, "swap slots"},
+    { swap_pressure, "swap pressure"},
+    { cow_fork, "cow fork"},
+    { lazy_sbrk, "lazy sbrk"},
+    { zero_page, "zero page"},
+    { megapages, "megapages"},
+    { 0, 0},
+  };
+
+  printf("pagingtests starting\n");
+
+  int fail = 0;
+  for (struct test *t = tests; t->s != 0; t++) {
+    if((n == 0) || strcmp(t->s, n) == 0) {
+      if(!run(t->f, t->s))
+        fail = 1;
+    }
+  }
+  if(!fail)
+    printf("ALL TESTS PASSED\n");
+  else
+    printf("SOME TESTS FAILED\n");
+  exit(fail);
+}
@@ -102,6 +102,12 @@ copyout(char *s)
       printf("read(pipe, %p, 8192) returned %d, not -1 or 0\n", addr, n);
       exit(1);
     }
+    // the failed read must leave the data in the pipe.
+    char c = 0;
+    if(read(fds[0], &c, 1) != 1 || c != 'x'){
+      printf("read(pipe, %p, 8192) lost the data\n", addr);
+      exit(1);
+    }
     close(fds[0]);
     close(fds[1]);
   }
@@ -780,6 +786,138 @@ pipe1(char *s)
 }
 
 
+// open more files and pipes at once than the fixed file table
+// used to hold (100); each child fills its file descriptors
+// and keeps them open until all have, then uses them.
+void
+manyfiles(char *s)
+{
+  enum { NCHILD=10, NPIPE=5 };
+  int ready[2], go[2], fds[NPIPE][2];
+  int i, j, pid, fd, ok, xstatus, fail = 0;
+  char c;
+
+  if(pipe(ready) < 0 || pipe(go) < 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(ready[0]);
+      close(go[1]);
+      for(j = 0; j < NPIPE && pipe(fds[j]) == 0; j++)
+        ;
+      fd = open("README", O_RDONLY);
+      // report either way, so that the parent doesn't wait.
+      ok = j == NPIPE && fd >= 0;
+      if(write(ready[1], ok ? "x" : "f", 1) != 1 || read(go[0], &c, 1) != 0)
+        exit(1);
+      if(!ok){
+        printf("%s: out of files after %d pipes\n", s, j);
+        exit(1);
+      }
+      for(j = 0; j < NPIPE; j++){
+        c = 'a' + i + j;
+        if(write(fds[j][1], &c, 1) != 1 || read(fds[j][0], &c, 1) != 1 ||
+           c != 'a' + i + j){
+          printf("%s: pipe %d failed\n", s, j);
+          exit(1);
+        }
+      }
+      if(read(fd, &c, 1) != 1){
+        printf("%s: read failed\n", s);
+        exit(1);
+      }
+      exit(0);
+    }
+  }
+  close(ready[1]);
+  close(go[0]);
+  for(i = 0; i < NCHILD; i++){
+    if(read(ready[0], &c, 1) != 1 || c != 'x'){
+      fail = 1;
+      break;
+    }
+  }
+  close(go[1]);
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      fail = 1;
+  }
+  exit(fail);
+}
+
+// many pairs of processes pass a counter back and forth over
+// their own pipes at once, so that many sleepers wait on
+// different channels, some of which share a hash bucket; each
+// wakeup must reach its own sleeper.
+void
+pingpong(char *s)
+{
+  enum { NPAIR=16, N=200 };
+  int i, j, n, pid, xstatus, fail = 0;
+  int ping[2], pong[2];
+
+  for(i = 0; i < NPAIR; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      if(pipe(ping) < 0 || pipe(pong) < 0){
+        printf("%s: pipe() failed\n", s);
+        exit(1);
+      }
+      pid = fork();
+      if(pid < 0){
+        printf("%s: fork failed\n", s);
+        exit(1);
+      }
+      // so that either side sees EOF if the other dies.
+      if(pid == 0){
+        close(ping[1]);
+        close(pong[0]);
+      } else {
+        close(ping[0]);
+        close(pong[1]);
+      }
+      for(j = 0; j < N; j++){
+        if(pid == 0){
+          if(read(ping[0], &n, sizeof(n)) != sizeof(n) || n != 2 * j)
+            exit(1);
+          n++;
+          if(write(pong[1], &n, sizeof(n)) != sizeof(n))
+            exit(1);
+        } else {
+          n = 2 * j;
+          if(write(ping[1], &n, sizeof(n)) != sizeof(n) ||
+             read(pong[0], &n, sizeof(n)) != sizeof(n) || n != 2 * j + 1){
+            printf("%s: pair %d: wrong value %d\n", s, i, n);
+            exit(1);
+          }
+        }
+      }
+      if(pid == 0)
+        exit(0);
+      wait(&xstatus);
+      exit(xstatus);
+    }
+  }
+  for(i = 0; i < NPAIR; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      fail = 1;
+  }
+  exit(fail);
+}
+
 // test if child is killed (status = -1)
 void
 killstatus(char *s)
@@ -865,6 +1003,190 @@ preempt(char *s)
   wait(0);
 }
 
+// a process at the lowest priority must still get to run
+// while CPU-bound processes at the highest keep busy.
+void
+priority(char *s)
+{
+  int pids[NCPU], pfds[2], pid, i;
+
+  if(setpriority(getpid(), -1) != -1 || setpriority(getpid(), NPRIO) != -1){
+    printf("%s: setpriority accepted a bad level\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCPU; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pids[i] == 0)
+      for(;;)
+        ;
+  }
+
+  pipe(pfds);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(pfds[0]);
+    if(setpriority(getpid(), NPRIO-1) < 0)
+      printf("%s: setpriority failed\n", s);
+    for(i = 0; i < 1000000; i++)
+      ;
+    if(write(pfds[1], "x", 1) != 1)
+      printf("%s: priority write error\n", s);
+    exit(0);
+  }
+
+  close(pfds[1]);
+  if(read(pfds[0], buf, sizeof(buf)) != 1){
+    printf("%s: low priority process starved\n", s);
+    exit(1);
+  }
+  close(pfds[0]);
+  for(i = 0; i < NCPU; i++)
+    kill(pids[i]);
+  for(i = 0; i < NCPU + 1; i++)
+    wait(0);
+}
+
+// a process's children start on its CPU's run queue; other
+// CPUs must steal them, and each must run to the end.
+void
+steal(char *s)
+{
+  enum { NCHILD=2*NCPU };
+  int i, j, pid, xstatus, seen = 0, fail = 0;
+  volatile int sum;
+
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(sum = 0, j = 0; j < 10000000; j++)
+        sum += j & 1;
+      exit(sum == 5000000 ? i : -2);
+    }
+  }
+  for(i = 0; i < NCHILD; i++){
+    if(wait(&xstatus) < 0){
+      printf("%s: wait failed\n", s);
+      exit(1);
+    }
+    if(xstatus < 0 || xstatus >= NCHILD || (seen & (1 << xstatus))){
+      printf("%s: child exited with %d\n", s, xstatus);
+      fail = 1;
+    } else
+      seen |= 1 << xstatus;
+  }
+  exit(fail || seen != (1 << NCHILD) - 1);
+}
+
+// many processes sleep at once for different numbers of ticks,
+// joining the timer queue in no particular order; each must
+// wake when due, not early and not much later.
+void
+sleeptimes(char *s)
+{
+  enum { NCHILD=10, SLACK=5 };
+  int i, n, t0, pid, xstatus, fail = 0;
+
+  if(sleep(0) != 0 || sleep(-1) != 0){
+    printf("%s: sleep(0) failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      n = 2 + (i * 7) % NCHILD * 3;
+      t0 = uptime();
+      if(sleep(n) != 0)
+        exit(1);
+      t0 = uptime() - t0;
+      if(t0 < n || t0 > n + SLACK){
+        printf("%s: sleep(%d) took %d ticks\n", s, n, t0);
+        exit(1);
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      fail = 1;
+  }
+
+  // a sleeper that is killed must leave the queue at once.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    sleep(1000);
+    exit(0);
+  }
+  sleep(2);
+  t0 = uptime();
+  kill(pid);
+  wait(&xstatus);
+  if(xstatus != -1 || uptime() - t0 > SLACK){
+    printf("%s: killed sleeper didn't exit\n", s);
+    fail = 1;
+  }
+  exit(fail);
+}
+
+// idle CPUs take no clock ticks until the first sleeper is
+// due; a lone sleeper on an idle machine must still wake on
+// time, and the clock must not lose the ticks that were
+// skipped. then again with one CPU kept busy.
+void
+idlesleep(char *s)
+{
+  enum { SLACK=5 };
+  static int ns[] = { 1, 2, 3, 5, 10, 20, 50 };
+  int i, j, t0, t, pid;
+
+  for(j = 0; j < 2; j++){
+    pid = 0;
+    if(j == 1 && (pid = fork()) == 0)
+      for(;;)
+        ;
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < sizeof(ns)/sizeof(ns[0]); i++){
+      t0 = uptime();
+      sleep(ns[i]);
+      t = uptime() - t0;
+      if(t < ns[i] || t > ns[i] + SLACK){
+        printf("%s: sleep(%d) took %d ticks\n", s, ns[i], t);
+        if(pid > 0)
+          kill(pid);
+        exit(1);
+      }
+    }
+    if(pid > 0){
+      kill(pid);
+      wait(0);
+    }
+  }
+  exit(0);
+}
+
 // try to find any races between exit and wait
 void
 exitwait(char *s)
@@ -2204,6 +2526,146 @@ sbrkmuch(char *s)
   }
 }
 
+// processes on every CPU allocate and free pages at once, so
+// that the per-CPU free lists run dry, refill, steal from one
+// another and give pages back.
+void
+sbrkpar(char *s)
+{
+  enum { NCHILD=2*NCPU, SZ=1024*1024 };
+  char *a, *p;
+  int i, j, pid, xstatus, fail = 0;
+
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(j = 0; j < 20; j++){
+        a = sbrk(SZ);
+        if(a == (char*)0xffffffffffffffffL){
+          printf("%s: sbrk failed\n", s);
+          exit(1);
+        }
+        for(p = a; p < a + SZ; p += PGSIZE)
+          *(int*)p = i + j;
+        for(p = a; p < a + SZ; p += PGSIZE){
+          if(*(int*)p != i + j){
+            printf("%s: wrong value at %p\n", s, p);
+            exit(1);
+          }
+        }
+        sbrk(-SZ);
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      fail = 1;
+  }
+  exit(fail);
+}
+
+// densely written heaps take 2-megabyte blocks from the buddy
+// allocator for megapages while sparse ones take single pages;
+// mixing them splits blocks, and exits must merge them again
+// for the next round.
+void
+buddy(char *s)
+{
+  enum { SZ=4*MEGAPGSIZE };
+  char *a, *p;
+  int i, j, pid, xstatus, stride;
+
+  for(i = 0; i < 5; i++){
+    for(j = 0; j < 2; j++){
+      pid = fork();
+      if(pid < 0){
+        printf("%s: fork failed\n", s);
+        exit(1);
+      }
+      if(pid == 0){
+        stride = j == 0 ? PGSIZE : 7 * PGSIZE;
+        a = sbrk(SZ);
+        if(a == (char*)0xffffffffffffffffL){
+          printf("%s: sbrk failed\n", s);
+          exit(1);
+        }
+        for(p = a; p < a + SZ; p += stride)
+          *(char**)p = p;
+        for(p = a; p < a + SZ; p += stride){
+          if(*(char**)p != p){
+            printf("%s: wrong value at %p\n", s, p);
+            exit(1);
+          }
+        }
+        exit(0);
+      }
+    }
+    for(j = 0; j < 2; j++){
+      wait(&xstatus);
+      if(xstatus != 0)
+        exit(1);
+    }
+  }
+  exit(0);
+}
+
+// new heap pages, and the page tables that map them, come
+// from pages zeroed while CPUs were idle; dirty a lot of
+// memory, free it, let the CPUs idle, and check that the
+// heap that reuses it reads as zeros. reads alone would see
+// the shared zero page, so write the first byte of each page
+// and check the rest of the fresh page.
+void
+zeroidle(char *s)
+{
+  enum { SZ=4*1024*1024 };
+  char *a, *p;
+  int i, pid, xstatus;
+
+  for(i = 0; i < 3; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      a = sbrk(SZ);
+      if(a == (char*)0xffffffffffffffffL)
+        exit(1);
+      memset(a, 0xAA, SZ);
+      exit(0);
+    }
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+    sleep(5);
+
+    a = sbrk(SZ);
+    if(a == (char*)0xffffffffffffffffL){
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    for(p = a; p < a + SZ; p += sizeof(uint64)){
+      if(*(uint64*)p != 0){
+        printf("%s: new memory at %p not zero\n", s, p);
+        exit(1);
+      }
+      if(((uint64)p % PGSIZE) == 0)
+        *p = 1;
+    }
+    sbrk(-SZ);
+  }
+  exit(0);
+}
+
 // can we read the kernel's memory?
 void
 kernmem(char *s)
@@ -2228,6 +2690,42 @@ kernmem(char *s)
   }
 }
 
+// the kernel copies to and from user pages through its direct
+// map of RAM, which is mostly megapages; copy through every
+// page of a large heap, wherever in RAM its pages landed.
+void
+kernmap(char *s)
+{
+  enum { SZ=32*1024*1024 };
+  char *base, *a;
+  uint64 v;
+  int fds[2];
+
+  base = sbrk(SZ);
+  if(base == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(a = base; a < base + SZ; a += PGSIZE)
+    *(char**)a = a;
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(a = base; a < base + SZ; a += PGSIZE){
+    if(write(fds[1], a, sizeof(v)) != sizeof(v) ||
+       read(fds[0], &v, sizeof(v)) != sizeof(v)){
+      printf("%s: copy failed\n", s);
+      exit(1);
+    }
+    if(v != (uint64)a){
+      printf("%s: read %p from %p\n", s, v, a);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
 // if we run the system out of memory, does it clean up the last
 // failed allocation?
 void
@@ -2802,7 +3300,11 @@ main(int argc, char *argv[])
     {bsstest, "bsstest"},
     {sbrkbasic, "sbrkbasic"},
     {sbrkmuch, "sbrkmuch"},
+    {sbrkpar, "sbrkpar"},
+    {buddy, "buddy"},
+    {zeroidle, "zeroidle"},
     {kernmem, "kernmem"},
+    {kernmap, "kernmap"},
     {sbrkfail, "sbrkfail"},
     {sbrkarg, "sbrkarg"},
     {validatetest, "validatetest"},
@@ -2816,8 +3318,14 @@ main(int argc, char *argv[])
     {iputtest, "iput"},
     {mem, "mem"},
     {pipe1, "pipe1"},
+    {manyfiles, "manyfiles"},
+    {pingpong, "pingpong"},
     {killstatus, "killstatus"},
     {preempt, "preempt"},
+    {priority, "priority"},
+    {steal, "steal"},
+    {sleeptimes, "sleeptimes"},
+    {idlesleep, "idlesleep"},
     {exitwait, "exitwait"},
     {rmdot, "rmdot"},
     {fourteen, "fourteen"},